@@ -18,14 +18,30 @@
  * m4 written from scratch
  */
 
+#ifdef __linux__
+/* For copy_file_range */
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 
-#ifndef _WIN32
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
 #include <sys/wait.h>
+#include <unistd.h>
 #endif
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,11 +53,36 @@
 #define NUM_NON_NEG_DIVS 10
 /* Number of diversions (0 to 9 and -1) */
 #define NUM_DIVS 11
+/* Diversion index that is a shortcut to the active named file diversion */
+#define DIV_FILE 11
 
 #define GROWTH 2
 #define LARGEGAP 2
 #define SMALLGAP 1
 
+/* Default maximum nesting depth of macro calls during argument collection */
+#define DEF_MAX_DEPTH 1024
+/* Default maximum growth of the input from macro expansion, in bytes */
+#define DEF_MAX_GROWTH ((size_t) 1 << 30)
+
+/* Size of the fixed output block that diversion 0 writes through to stdout */
+#define OUT_BLOCK 65536
+/* Initial size of the other diversion buffers and the result buffer */
+#define DIVGAP BUFSIZ
+/* Maximum number of named file diversions that are open at once */
+#define MAX_OPEN_FILES 64
+
+#ifdef _WIN32
+#define write _write
+#define read _read
+#define open _open
+#define close _close
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 /* Built-in macro identifiers (user defined macros are use 0) */
 /* The define macro */
 #define BI_DEFINE 1
@@ -73,6 +114,42 @@
 #define BI_TRACEON 14
 /* The traceoff macro */
 #define BI_TRACEOFF 15
+/* The changecom macro */
+#define BI_CHANGECOM 16
+/* The divfile macro */
+#define BI_DIVFILE 17
+/* The pushdef macro */
+#define BI_PUSHDEF 18
+/* The popdef macro */
+#define BI_POPDEF 19
+
+/* Delimiter identifiers (0 is used for no delimiter) */
+/* Left quote */
+#define DL_LQ 1
+/* Right quote */
+#define DL_RQ 2
+/* Start of comment */
+#define DL_SCOM 3
+/* End of comment */
+#define DL_ECOM 4
+/* Number of delimiter identifiers, including 0 */
+#define NUM_DELIMS 5
+
+/* Delimiter identifier to bit, for masks of the active delimiters */
+#define DL_BIT(id) (1 << (id))
+
+/* Whitespace that is eaten after macro calls, commas and brackets */
+#define ISWS(ch) ((ch) == ' ' || (ch) == '\t' || (ch) == '\n' || (ch) == '\r')
+
+/* Word (size_t) with every byte set to b */
+#define WORD_OF(b) ((size_t) -1 / UCHAR_MAX * (b))
+/* Sets the high bit of each byte of the word w that is zero (exact) */
+#define ZERO_BYTES(w) (~((((w) & WORD_OF(0x7F)) + WORD_OF(0x7F)) \
+    | (w) | WORD_OF(0x7F)))
+/* Tests if every byte of the word w is whitespace */
+#define ALL_WS(w) ((ZERO_BYTES((w) ^ WORD_OF(' ')) \
+    | ZERO_BYTES((w) ^ WORD_OF('\t')) | ZERO_BYTES((w) ^ WORD_OF('\n')) \
+    | ZERO_BYTES((w) ^ WORD_OF('\r'))) == WORD_OF(0x80))
 
 /* size_t overflow checks */
 #define AOF(a, b) ((a) > SIZE_MAX - (b))
@@ -111,12 +188,32 @@ struct mem {
     size_t s;                   /* Size of memory */
 };
 
-/* For macro definitions. Link together to form a doubly linked list. */
+/*
+ * A definition that has been shadowed by pushdef. These link together to
+ * form a singly linked list, which is the definition stack of a macro name.
+ */
+struct pdef {
+    struct mem text;            /* Macro replacement text */
+    size_t text_cap;            /* Allocated size of the text */
+    int built_in;               /* Built-in macro identifier */
+    struct pdef *next;          /* Next shadowed definition (last is NULL) */
+};
+
+/*
+ * For macro definitions. Link together to form a doubly linked list.
+ * The name is stored in the same allocation, straight after the node, so
+ * it is allocated once only. The text is updated in place when a macro is
+ * redefined, and its memory is only reallocated when it is too small.
+ * The node always holds the top definition, so that lookup never has to
+ * look at the definition stack.
+ */
 struct mdef {
     struct mdef *prev;          /* Previous node (first node is NULL) */
     struct mem name;            /* Macro name */
     struct mem text;            /* Macro replacement text */
+    size_t text_cap;            /* Allocated size of the text */
     int built_in;               /* Built-in macro identifier */
+    struct pdef *below;         /* Definitions shadowed by pushdef */
     struct mdef *next;          /* Next node (last node is NULL) */
 };
 
@@ -128,11 +225,15 @@ struct mdef {
  *  +-------------+---------+
  *  |<---- s ---->|<-- g -->|
  *  p
+ *
+ * When fd is not -1 the buffer is a fixed-size block that is written to
+ * the file descriptor when it fills up, instead of being grown.
  */
 struct rear_buf {
     char *p;                    /* Pointer to memory */
     size_t s;                   /* Total buffer size */
     size_t gs;                  /* Gap size */
+    int fd;                     /* Flush file descriptor (-1 for none) */
 };
 
 
@@ -144,11 +245,16 @@ struct rear_buf {
  *  +---------+-------------+
  *  |<-- g -->|<---- s ---->|
  *  p
+ *
+ * Text cannot be prepended beyond a text size of max (0 is no limit).
+ * over is set when this is attempted, so the error can be reported.
  */
 struct front_buf {
     char *p;                    /* Pointer to memory */
     size_t s;                   /* Total buffer size */
     size_t gs;                  /* Gap size */
+    size_t max;                 /* Maximum text size */
+    int over;                   /* Maximum text size would be exceeded */
 };
 
 /*
@@ -159,13 +265,41 @@ struct front_buf {
 struct margs {
     struct margs *prev;         /* Previous node (first is NULL) */
     struct mem text;            /* Macro replacement text before arguments are substituted */
+    size_t text_cap;            /* Allocated size of the text */
     size_t bracket_depth;       /* For nested brackets: only unquoted brackets are counted */
     size_t act_arg;             /* Active argument */
-    struct rear_buf *args[MAXARGS];     /* Storage of the collected arguments before substitution */
+    size_t depth;               /* Nesting depth (the bottom node is 1) */
+    struct rear_buf *args[MAXARGS];     /* Macro name, then the collected arguments before substitution */
     int built_in;               /* Built-in macro identifier */
     struct margs *next;         /* Next node (last is NULL) */
 };
 
+/*
+ * A named file diversion. Its output goes through a fixed-size block that
+ * is written to the file when it fills up. The block, and the file
+ * descriptor, only exist while the file is open. Files are closed lazily,
+ * only when too many are open, or at the end. These link together to form
+ * a singly linked list, in most recently used order.
+ */
+struct file_div {
+    char *fn;                   /* Filename */
+    struct rear_buf *rb;        /* Output block (NULL when closed) */
+    int opened;                 /* Has been opened before (so append) */
+    struct file_div *next;      /* Next node (last is NULL) */
+};
+
+/*
+ * The quote and comment delimiters, and the automaton that recognises them.
+ * The automaton is recompiled every time the delimiters change. It maps the
+ * first byte of the input to the delimiters that start with that byte, so
+ * ordinary characters are rejected with one table look up, and only the few
+ * candidates are compared in full.
+ */
+struct delim {
+    struct mem d[NUM_DELIMS];   /* Delimiter text (index 0 is not used) */
+    unsigned char lead[UCHAR_MAX + 1];  /* First byte to delimiter bits */
+};
+
 struct rear_buf *init_rear_buf(size_t s)
 {
     /* Initalises a rear buffer */
@@ -178,6 +312,7 @@ struct rear_buf *init_rear_buf(size_t s)
     }
     rb->s = s;
     rb->gs = s;
+    rb->fd = -1;
     return rb;
 }
 
@@ -193,6 +328,8 @@ struct front_buf *init_front_buf(size_t s)
     }
     fb->s = s;
     fb->gs = s;
+    fb->max = 0;
+    fb->over = 0;
     return fb;
 }
 
@@ -214,33 +351,38 @@ void free_front_buf(struct front_buf *fb)
     }
 }
 
-struct mdef *create_mdef_node(void)
+struct mdef *create_mdef_node(char *name, size_t s)
 {
     /*
-     * Creates a macro definition node.
-     * Does not link it into the doubly linked list.
+     * Creates a macro definition node, with the name stored straight after
+     * the node. Does not link it into the doubly linked list.
      */
     struct mdef *md;
-    if ((md = malloc(sizeof(struct mdef))) == NULL)
+    if (AOF(sizeof(struct mdef), s))
+        return NULL;
+    if ((md = malloc(sizeof(struct mdef) + s)) == NULL)
         return NULL;
     md->prev = NULL;
-    md->name.p = NULL;
-    md->name.s = 0;
+    md->name.p = (char *) (md + 1);
+    memcpy(md->name.p, name, s);
+    md->name.s = s;
     md->text.p = NULL;
     md->text.s = 0;
+    md->text_cap = 0;
     md->built_in = 0;           /* Default is 0: User defined macro */
+    md->below = NULL;
     md->next = NULL;
     return md;
 }
 
-int stack_on_mdef(struct mdef **md)
+int stack_on_mdef(struct mdef **md, char *name, size_t s)
 {
     /*
      * Add a new macro definition node to top of the macro definition
      * doubly linked list (becomes the new head).
      */
     struct mdef *t;
-    if ((t = create_mdef_node()) == NULL)
+    if ((t = create_mdef_node(name, s)) == NULL)
         return 1;
     if (*md != NULL) {
         t->next = *md;
@@ -250,20 +392,25 @@ int stack_on_mdef(struct mdef **md)
     return 0;
 }
 
-int mem_to_mem_cpy(struct mem *dest, struct mem *source)
+int mem_set(struct mem *dest, size_t * cap, char *p, size_t s)
 {
     /*
-     * Copies source mem to the destination mem, freeing the destination mem
-     * if not NULL.
+     * Copies s bytes at p into the destination mem, in place if it has
+     * the capacity, otherwise its memory is reallocated with room to grow.
      */
     char *t;
-    if ((t = malloc(source->s)) == NULL) {
-        return 1;
+    size_t new_cap;
+    if (s > *cap) {
+        new_cap = MOF(*cap, GROWTH) || *cap * GROWTH < s ? s : *cap * GROWTH;
+        if ((t = malloc(new_cap)) == NULL)
+            return 1;
+        free(dest->p);
+        dest->p = t;
+        *cap = new_cap;
     }
-    free(dest->p);
-    dest->p = t;
-    memcpy(dest->p, source->p, source->s);
-    dest->s = source->s;
+    if (s)
+        memcpy(dest->p, p, s);
+    dest->s = s;
     return 0;
 }
 
@@ -285,6 +432,14 @@ int rear_buf_mem_cmp(struct rear_buf *rb, struct mem *m)
     return 0;
 }
 
+int rear_buf_rear_buf_cmp(struct rear_buf *rb1, struct rear_buf *rb2)
+{
+    /* Compares the text of two rear buffers */
+    if (TEXTSIZE(rb1) != TEXTSIZE(rb2))
+        return 1;
+    return memcmp(rb1->p, rb2->p, TEXTSIZE(rb1)) ? 1 : 0;
+}
+
 int rear_buf_char_cmp(struct rear_buf *rb, char ch)
 {
     /* Compares the text of a rear buffer to a char */
@@ -299,6 +454,21 @@ int rear_buf_char_cmp(struct rear_buf *rb, char ch)
     return 0;
 }
 
+struct mdef *mdef_search(struct mdef *md, struct rear_buf *token)
+{
+    /*
+     * Searches for a token in the macro names of the macro definition doubly
+     * linked list. Returns the node if found, else it returns NULL.
+     */
+    struct mdef *t = md;
+    while (t != NULL) {
+        if (!rear_buf_mem_cmp(token, &t->name))
+            return t;
+        t = t->next;
+    }
+    return NULL;
+}
+
 struct mem *token_search(struct mdef *md, struct rear_buf *token, int *bi)
 {
     /*
@@ -308,23 +478,57 @@ struct mem *token_search(struct mdef *md, struct rear_buf *token, int *bi)
      * if a match is found, which is the built-in identifier (user defined
      * macros have a built-in identifier of zero).
      */
-    struct mdef *t = md, *next;
-    while (t != NULL) {
-        next = t->next;
-        if (!rear_buf_mem_cmp(token, &t->name)) {
-            *bi = t->built_in;
-            return &t->text;
-        }
-        t = next;
-    }
-    return NULL;
+    struct mdef *t;
+    if ((t = mdef_search(md, token)) == NULL)
+        return NULL;
+    *bi = t->built_in;
+    return &t->text;
+}
+
+int push_mdef(struct mdef *md)
+{
+    /*
+     * Pushes the top definition of a macro definition node onto its
+     * definition stack, leaving the node with empty text.
+     */
+    struct pdef *t;
+    if ((t = malloc(sizeof(struct pdef))) == NULL)
+        return 1;
+    t->text = md->text;
+    t->text_cap = md->text_cap;
+    t->built_in = md->built_in;
+    t->next = md->below;
+    md->below = t;
+    md->text.p = NULL;
+    md->text.s = 0;
+    md->text_cap = 0;
+    return 0;
+}
+
+void pop_mdef(struct mdef *md)
+{
+    /*
+     * Discards the top definition of a macro definition node, restoring
+     * the one below it. The definition stack must not be empty.
+     */
+    struct pdef *t = md->below;
+    free(md->text.p);
+    md->text = t->text;
+    md->text_cap = t->text_cap;
+    md->built_in = t->built_in;
+    md->below = t->next;
+    free(t);
 }
 
 void free_mdef_node(struct mdef *md)
 {
-    /* Frees a macro definition node */
+    /*
+     * Frees a macro definition node (the name is part of the node),
+     * including all of its shadowed definitions.
+     */
     if (md != NULL) {
-        free(md->name.p);
+        while (md->below != NULL)
+            pop_mdef(md);
         free(md->text.p);
         free(md);
     }
@@ -346,10 +550,10 @@ void free_margs_node(struct margs *ma)
     /* Free a macro arguments node (a stack node) */
     size_t i;
     if (ma != NULL) {
-        /* Arg 0 is not allocated, so no need to free */
-        for (i = 1; i < MAXARGS; ++i) {
+        for (i = 0; i < MAXARGS; ++i) {
             free_rear_buf(*(ma->args + i));
         }
+        free(ma->text.p);
         free(ma);
     }
 }
@@ -365,68 +569,23 @@ void free_margs_linked_list(struct margs *ma)
     }
 }
 
-void print_token(struct rear_buf *token)
+void print_macro_chain(struct margs *ma)
 {
-    /* Prints a rear buffer to stderr, such as a token (used by traceon) */
-    size_t i = 0;
-    size_t ts = TEXTSIZE(token);
-    char ch;
-    if (!ts)
-        return;
-    for (i = 0; i < ts; ++i) {
-        ch = *(token->p + i);
-        if (isgraph((unsigned char) ch))
-            putc(ch, stderr);
-        else
-            fprintf(stderr, "%02X", (unsigned char) ch);
+    /*
+     * Prints the names of the macros on the stack to stderr, from the
+     * innermost call outwards. Used when a limit is exceeded.
+     */
+    struct margs *t;
+    fprintf(stderr, "Macro chain:");
+    for (t = ma; t != NULL; t = t->next) {
+        putc(' ', stderr);
+        fwrite((*t->args)->p, 1, TEXTSIZE(*t->args), stderr);
+        if (t->next != NULL)
+            fprintf(stderr, " <-");
     }
     putc('\n', stderr);
 }
 
-int dump_stack(struct margs *ma)
-{
-    /* Prints the macro arguments linked list to stderr (used in traceon) */
-    struct margs *t = ma, *next;
-    size_t node = 0, i, s;
-
-    fprintf(stderr, "*** Dump stack ***\n");
-
-    while (t != NULL) {
-        next = t->next;
-
-        fprintf(stderr, "NODE: %lu\n", (unsigned long) node);
-        fprintf(stderr, "Macro text: ");
-        if (t->text.p == NULL)
-            fprintf(stderr, "NULL");
-        else if (fwrite(t->text.p, 1, t->text.s, stderr) != t->text.s)
-            return 1;
-        fprintf(stderr, "\nMacro text size: %lu\n",
-                (unsigned long) t->text.s);
-        fprintf(stderr, "Bracket depth: %lu\n",
-                (unsigned long) t->bracket_depth);
-        fprintf(stderr, "Active argument: %lu\n",
-                (unsigned long) t->act_arg);
-
-        /* Arg 0 is not allocated */
-        for (i = 1; i < MAXARGS; ++i) {
-            s = TEXTSIZE(*(t->args + i));
-            if (s) {
-                fprintf(stderr, "Argument %lu: ", (unsigned long) i);
-                if (fwrite((*(t->args + i))->p, 1, s, stderr)
-                    != s)
-                    return 1;
-                putc('\n', stderr);
-            }
-        }
-
-        fprintf(stderr, "Built-in macro identifier: %d\n", t->built_in);
-
-        ++node;
-        t = next;
-    }
-    return 0;
-}
-
 struct margs *create_margs_node(void)
 {
     /*
@@ -440,13 +599,14 @@ struct margs *create_margs_node(void)
     ma->prev = NULL;
     ma->text.p = NULL;
     ma->text.s = 0;
+    ma->text_cap = 0;
     ma->bracket_depth = 0;
-    ma->act_arg = 1;            /* Ignore macro name for now, fix this later ... 0; */
+    ma->act_arg = 1;            /* Arg 0 is the macro name, so start at 1 */
+    ma->depth = 1;
     ma->next = NULL;
     for (i = 0; i < MAXARGS; ++i)
         *(ma->args + i) = NULL;
-    /* Do not need to allocate arg 0 as it is not used */
-    for (i = 1; i < MAXARGS; ++i) {
+    for (i = 0; i < MAXARGS; ++i) {
         if ((*(ma->args + i) = init_rear_buf(SMALLGAP)) == NULL) {
             free_margs_node(ma);
             return NULL;
@@ -455,29 +615,46 @@ struct margs *create_margs_node(void)
     return ma;
 }
 
-int stack_on_margs(struct margs **ma)
+int stack_on_margs(struct margs **ma, struct margs **spare)
 {
     /*
-     * Creates a new margs node and links it on top of the stack creating
-     * a new head.
+     * Links a margs node on top of the stack creating a new head.
+     * A node from the spare list is reused if there is one, otherwise a new
+     * node is created.
      */
     struct margs *t;
-    if ((t = create_margs_node()) == NULL)
+    size_t i;
+    if (*spare != NULL) {
+        t = *spare;
+        *spare = t->next;
+        t->bracket_depth = 0;
+        t->act_arg = 1;
+        for (i = 0; i < MAXARGS; ++i)
+            DELETEBUF(*(t->args + i));
+    } else if ((t = create_margs_node()) == NULL) {
         return 1;
+    }
+    t->prev = NULL;
+    t->next = *ma;
+    t->depth = 1;
     if (*ma != NULL) {
-        t->next = *ma;
         (*ma)->prev = t;
+        t->depth = (*ma)->depth + 1;
     }
     *ma = t;
     return 0;
 }
 
-void delete_margs_stack_head(struct margs **ma)
+void delete_margs_stack_head(struct margs **ma, struct margs **spare)
 {
     /*
-     * Deletes the head margs node from the top of the macro arguments doubly
+     * Removes the head margs node from the top of the macro arguments doubly
      * linked list. The new head will be the next node in the list, or NULL
-     * if there are no more.
+     * if there are no more. The old head is kept on the spare list, so
+     * that the frame can be reused by the next call. As a macro call is
+     * removed before its result is rescanned, a call in tail position
+     * (such as a recursive call at the end of the result) reuses the frame
+     * of the call that produced it, and the stack does not grow.
      */
     struct margs *t;
     /* Empty list, nothing to do */
@@ -485,8 +662,11 @@ void delete_margs_stack_head(struct margs **ma)
         return;
     /* Store pointer to next node. Will be NULL if there are no more */
     t = (*ma)->next;
-    /* Free head node */
-    free_margs_node(*ma);
+    if (t != NULL)
+        t->prev = NULL;
+    /* Move old head onto the spare list */
+    (*ma)->next = *spare;
+    *spare = *ma;
     /* Move the head down to the next node */
     *ma = t;
 }
@@ -538,19 +718,82 @@ int grow_front_buf(struct front_buf *fb, size_t fixed_chunk)
     if ((t = malloc(new_s)) == NULL)
         return 1;
     memcpy(t + fb->gs + increase, fb->p + fb->gs, TEXTSIZE(fb));
+    free(fb->p);
     fb->p = t;
     fb->s = new_s;
     fb->gs += increase;
     return 0;
 }
 
+void compile_delims(struct delim *dl)
+{
+    /* Builds the first byte table of the delimiter automaton */
+    int id;
+    memset(dl->lead, 0, sizeof(dl->lead));
+    for (id = 1; id < NUM_DELIMS; ++id)
+        if (dl->d[id].s)
+            dl->lead[(unsigned char) *dl->d[id].p] |= DL_BIT(id);
+}
+
+int set_delim(struct delim *dl, int id, char *p, size_t s)
+{
+    /*
+     * Sets one delimiter. An empty delimiter is disabled.
+     * Does not recompile the automaton.
+     */
+    char *t = NULL;
+    if (s && (t = malloc(s)) == NULL)
+        return 1;
+    if (s)
+        memcpy(t, p, s);
+    free(dl->d[id].p);
+    dl->d[id].p = t;
+    dl->d[id].s = s;
+    return 0;
+}
+
+void free_delims(struct delim *dl)
+{
+    /* Frees the delimiter text */
+    int id;
+    for (id = 1; id < NUM_DELIMS; ++id)
+        free(dl->d[id].p);
+}
+
+int match_delim(struct delim *dl, char *p, size_t s, int mask)
+{
+    /*
+     * Returns the identifier of the longest delimiter in mask that the
+     * s bytes at p start with, or 0 if there is no match.
+     */
+    int bits = dl->lead[(unsigned char) *p] & mask;
+    int id, match = 0;
+    size_t ms = 0;
+    for (id = 1; bits; ++id) {
+        if (bits & DL_BIT(id)) {
+            bits &= ~DL_BIT(id);
+            if (dl->d[id].s > ms && dl->d[id].s <= s
+                && !memcmp(p, dl->d[id].p, dl->d[id].s)) {
+                match = id;
+                ms = dl->d[id].s;
+            }
+        }
+    }
+    return match;
+}
+
 int read_token(struct front_buf *input, struct rear_buf *token,
-               int *end_of_input)
+               int *end_of_input, struct delim *dl, int mask, int *type)
 {
-    /* Reads a token from the input */
+    /*
+     * Reads a token from the input. A delimiter in mask is read as one
+     * token and its identifier is stored in type (otherwise type is 0).
+     */
     char ch;
+    size_t ds;
     /* Clear the token */
     DELETEBUF(token);
+    *type = 0;
 
     /* Check for end of input buffer */
     if (input->gs == input->s) {
@@ -562,6 +805,19 @@ int read_token(struct front_buf *input, struct rear_buf *token,
     /* Read first text char from the input front buffer */
     ch = *(input->p + input->gs);
 
+    /* Delimiters take priority */
+    if (dl->lead[(unsigned char) ch] & mask
+        && (*type = match_delim(dl, input->p + input->gs,
+                                input->s - input->gs, mask))) {
+        ds = dl->d[*type].s;
+        if (token->gs < ds && grow_rear_buf(token, ds))
+            return 1;
+        memcpy(token->p, input->p + input->gs, ds);
+        token->gs -= ds;
+        input->gs += ds;
+        return 0;
+    }
+
     /* If the token gap is empty, make it bigger */
     if (!token->gs)
         if (grow_rear_buf(token, 0))
@@ -596,6 +852,107 @@ int read_token(struct front_buf *input, struct rear_buf *token,
     return 0;
 }
 
+void skip_whitespace(struct front_buf *fb, struct delim *dl, int mask)
+{
+    /*
+     * Deletes a run of whitespace from the start of a front buffer,
+     * stopping at a delimiter in mask. When no whitespace character can
+     * start a delimiter, the run is scanned a word at a time.
+     */
+    size_t w;
+    char ch;
+    if (!((dl->lead[' '] | dl->lead['\t'] | dl->lead['\n']
+           | dl->lead['\r']) & mask)) {
+        while (fb->s - fb->gs >= sizeof(size_t)) {
+            memcpy(&w, fb->p + fb->gs, sizeof(size_t));
+            if (!ALL_WS(w))
+                break;
+            fb->gs += sizeof(size_t);
+        }
+    }
+    while (fb->gs < fb->s) {
+        ch = *(fb->p + fb->gs);
+        if (!ISWS(ch) || (dl->lead[(unsigned char) ch] & mask
+                          && match_delim(dl, fb->p + fb->gs,
+                                         fb->s - fb->gs, mask)))
+            break;
+        ++fb->gs;
+    }
+}
+
+void skip_to_newline(struct front_buf *fb)
+{
+    /*
+     * Deletes a front buffer up to and including the next newline character,
+     * or to the end if there is no newline.
+     */
+    char *q;
+    if ((q = memchr(fb->p + fb->gs, '\n', fb->s - fb->gs)) != NULL)
+        fb->gs = q - fb->p + 1;
+    else
+        fb->gs = fb->s;
+}
+
+void skip_arg(struct front_buf *input, struct delim *dl)
+{
+    /*
+     * Deletes the raw text of a macro argument from the input without
+     * expanding it. Stops at the unquoted comma or close bracket that ends
+     * the argument, which is left in the input. Quotes, comments and nested
+     * brackets are respected.
+     */
+    size_t quote_depth = 0;
+    size_t bracket_depth = 0;
+    int comment_on = 0;
+    int id, mask;
+    char ch;
+    while (input->gs < input->s) {
+        ch = *(input->p + input->gs);
+        mask = comment_on ? DL_BIT(DL_ECOM)
+            : quote_depth ? DL_BIT(DL_LQ) | DL_BIT(DL_RQ)
+            : DL_BIT(DL_LQ) | DL_BIT(DL_SCOM);
+        if (dl->lead[(unsigned char) ch] & mask
+            && (id = match_delim(dl, input->p + input->gs,
+                                 input->s - input->gs, mask))) {
+            if (id == DL_LQ)
+                ++quote_depth;
+            else if (id == DL_RQ)
+                --quote_depth;
+            else
+                comment_on = id == DL_SCOM;
+            input->gs += dl->d[id].s;
+            continue;
+        }
+        if (!quote_depth && !comment_on) {
+            if (ch == '(') {
+                ++bracket_depth;
+            } else if (ch == ')') {
+                if (!bracket_depth)
+                    return;
+                --bracket_depth;
+            } else if (ch == ',' && !bracket_depth) {
+                return;
+            }
+        }
+        ++input->gs;
+    }
+}
+
+int front_buf_room(struct front_buf *fb, size_t s)
+{
+    /*
+     * Makes room to prepend s bytes of text into a front buffer,
+     * enforcing the maximum text size.
+     */
+    if (fb->max && (AOF(TEXTSIZE(fb), s) || TEXTSIZE(fb) + s > fb->max)) {
+        fb->over = 1;
+        return 1;
+    }
+    if (fb->gs < s && grow_front_buf(fb, s))
+        return 1;
+    return 0;
+}
+
 int insert_file(struct front_buf *fb, char *fn)
 {
     /* Prepends a file into a front buffer */
@@ -605,9 +962,8 @@ int insert_file(struct front_buf *fb, char *fn)
         return 1;
     if (!fs)
         return 0;
-    if (fb->gs < fs)
-        if (grow_front_buf(fb, fs))
-            return 1;
+    if (front_buf_room(fb, fs))
+        return 1;
     if ((fp = fopen(fn, "rb")) == NULL)
         return 1;
     if (fread(fb->p + fb->gs - fs, 1, fs, fp) != fs) {
@@ -628,38 +984,85 @@ int insert_rear_in_front_buf(struct front_buf *fb, struct rear_buf *rb)
      * to the input front buffer.
      */
     size_t ts = TEXTSIZE(rb);
-    if (fb->gs < ts)
-        if (grow_front_buf(fb, ts))
-            return 1;
+    if (front_buf_room(fb, ts))
+        return 1;
     memcpy(fb->p + fb->gs - ts, rb->p, ts);
     fb->gs -= ts;
     return 0;
 }
 
+int insert_str_in_front_buf(struct front_buf *fb, char *str)
+{
+    /* Prepends a string into a front buffer */
+    size_t len = strlen(str);
+    if (front_buf_room(fb, len))
+        return 1;
+    memcpy(fb->p + fb->gs - len, str, len);
+    fb->gs -= len;
+    return 0;
+}
+
 int insert_ch_in_front_buf(struct front_buf *fb, char ch)
 {
     /*
      * Prepends a character into a front buffer.
      * Used to push a char into the input.
      */
-    if (!fb->gs)
-        if (grow_front_buf(fb, 1))
-            return 1;
+    if (front_buf_room(fb, 1))
+        return 1;
     *(fb->p + fb->gs - 1) = ch;
     --fb->gs;
     return 0;
 }
 
+int write_all(int fd, char *p, size_t s)
+{
+    /* Writes all s bytes to a file descriptor, retrying partial writes */
+    int w;
+    size_t n;
+    while (s) {
+        n = s > INT_MAX ? INT_MAX : s;
+        if ((w = write(fd, p, n)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        p += w;
+        s -= w;
+    }
+    return 0;
+}
+
+int flush_rear_buf(struct rear_buf *rb)
+{
+    /* Writes the text of a fixed-size block to its file descriptor */
+    if (write_all(rb->fd, rb->p, TEXTSIZE(rb)))
+        return 1;
+    DELETEBUF(rb);
+    return 0;
+}
+
 int rear_buf_append_rear_buf(struct rear_buf *rb_dest,
                              struct rear_buf *rb_source)
 {
-    /* Appends source rear buffer to the end of the destination rear buffer */
+    /*
+     * Appends source rear buffer to the end of the destination rear buffer.
+     * If the destination is a fixed-size block it is flushed when full, and
+     * text that is larger than the whole block is written straight through.
+     */
     /* No storage */
     if (rb_dest == NULL)
         return 1;
     /* Nothing to copy */
     if (rb_source == NULL)
         return 0;
+    if (TEXTSIZE(rb_source) > rb_dest->gs && rb_dest->fd != -1) {
+        if (flush_rear_buf(rb_dest))
+            return 1;
+        if (TEXTSIZE(rb_source) > rb_dest->gs)
+            return write_all(rb_dest->fd, rb_source->p,
+                             TEXTSIZE(rb_source));
+    }
     if (TEXTSIZE(rb_source) > rb_dest->gs
         && grow_rear_buf(rb_dest, TEXTSIZE(rb_source)))
         return 1;
@@ -669,6 +1072,83 @@ int rear_buf_append_rear_buf(struct rear_buf *rb_dest,
     return 0;
 }
 
+int trace_mem(struct rear_buf *tb, char *p, size_t s, int escape)
+{
+    /*
+     * Appends text to the trace block. If escape is set, then the characters
+     * that would break the one line per call format are escaped.
+     * The block is flushed when full.
+     */
+    size_t i, n;
+    unsigned char ch;
+    char esc[5];
+    for (i = 0; i < s; ++i) {
+        ch = *(p + i);
+        n = 2;
+        if (!escape) {
+            *esc = ch;
+            n = 1;
+        } else if (ch == '\\') {
+            strcpy(esc, "\\\\");
+        } else if (ch == '\n') {
+            strcpy(esc, "\\n");
+        } else if (ch == '\t') {
+            strcpy(esc, "\\t");
+        } else if (!isprint(ch)) {
+            sprintf(esc, "\\x%02X", ch);
+            n = 4;
+        } else {
+            *esc = ch;
+            n = 1;
+        }
+        if (tb->gs < n && flush_rear_buf(tb))
+            return 1;
+        memcpy(tb->p + TEXTSIZE(tb), esc, n);
+        tb->gs -= n;
+    }
+    return 0;
+}
+
+int trace_call(struct rear_buf *tb, struct margs *ma, int brackets)
+{
+    /*
+     * Writes a one line record of the macro call at the stack head to the
+     * trace block, in the form: m4trace: -depth- name(`arg1', `arg2')
+     */
+    char hdr[32];
+    size_t j;
+    sprintf(hdr, "m4trace: -%lu- ", (unsigned long) ma->depth);
+    if (trace_mem(tb, hdr, strlen(hdr), 0)
+        || trace_mem(tb, (*ma->args)->p, TEXTSIZE(*ma->args), 1))
+        return 1;
+    if (brackets) {
+        for (j = 1; j <= ma->act_arg; ++j) {
+            if (trace_mem(tb, j == 1 ? "(`" : ", `", j == 1 ? 2 : 3, 0)
+                || trace_mem(tb, (*(ma->args + j))->p,
+                             TEXTSIZE(*(ma->args + j)), 1)
+                || trace_mem(tb, "'", 1, 0))
+                return 1;
+        }
+        if (trace_mem(tb, ")", 1, 0))
+            return 1;
+    }
+    return trace_mem(tb, "\n", 1, 0);
+}
+
+int traced(struct margs *ma, int trace_all, struct mdef *tn,
+           size_t trace_depth)
+{
+    /*
+     * Checks if the macro call at the stack head passes the trace filters:
+     * all macros or a listed macro name, not deeper than the trace depth.
+     */
+    if (!trace_all && tn == NULL)
+        return 0;
+    if (trace_depth && ma->depth > trace_depth)
+        return 0;
+    return trace_all || mdef_search(tn, *ma->args) != NULL;
+}
+
 int sub_args(struct rear_buf *result, struct mem *text,
              struct rear_buf **args)
 {
@@ -689,7 +1169,7 @@ int sub_args(struct rear_buf *result, struct mem *text,
             dollar_encountered = 1;
         } else if (dollar_encountered && isdigit((unsigned char) ch)
                    && ch != '0') {
-            /* Insert argument (arg 0 is not allocated) */
+            /* Insert argument (arg 0, the macro name, is not substituted) */
             if (rear_buf_append_rear_buf
                 (result, *(args + (unsigned char) ch - '0')))
                 return 1;
@@ -742,13 +1222,9 @@ int add_built_in_macro(struct mdef **md, char *name_str, int bi)
      * This could be the first node, in which case the macro definition list
      * will commence.
      */
-    if (stack_on_mdef(md))
+    if (stack_on_mdef(md, name_str, s))
         return 1;
 
-    if (((*md)->name.p = malloc(s)) == NULL)
-        return 1;
-    memcpy((*md)->name.p, name_str, s);
-    (*md)->name.s = s;
     (*md)->built_in = bi;
     return 0;
 }
@@ -760,12 +1236,16 @@ void undefine_macro(struct mdef **md, struct rear_buf *macro_name)
      * and if found, removes it.
      */
     struct mdef *t = *md, *next;
+    /* Empty list, nothing to do */
+    if (t == NULL)
+        return;
     /* Case 1: Match occurs at head node */
     if (!rear_buf_mem_cmp(macro_name, &t->name)) {
         /* Repoint head */
         *md = t->next;
         /* NULL the previous of the new head */
-        (*md)->prev = NULL;
+        if (*md != NULL)
+            (*md)->prev = NULL;
         /* Free old head */
         free_mdef_node(t);
         return;
@@ -797,15 +1277,258 @@ int undivert(struct rear_buf *dest, struct rear_buf *source)
     /*
      * Appends the source diversion buffer onto the end of the destination
      * diversion buffer, and empties the source diversion buffer.
-     * Any diversion buffer (0 to 9 and -1) can be undiverted into any
+     * Any diversion buffer (1 to 9 and -1) can be undiverted into any
      * diversion buffer. It does not change the active diversion index.
+     * Diversion 0 writes through to stdout, so undiverting it does nothing.
      */
+    if (source->fd != -1)
+        return 0;
     if (rear_buf_append_rear_buf(dest, source))
         return 1;
     DELETEBUF(source);
     return 0;
 }
 
+size_t ifelse_branch(struct margs *ma)
+{
+    /*
+     * Returns the index of the ifelse argument that is selected, or 0 if
+     * none is. Arguments are taken in threes: if the first two are equal,
+     * then the third is selected, otherwise the next three are tried.
+     * A single argument left over at the end is the default.
+     */
+    size_t n = ma->act_arg, i;
+    for (i = 1; i + 2 <= n; i += 3)
+        if (!rear_buf_rear_buf_cmp(*(ma->args + i), *(ma->args + i + 1)))
+            return i + 2;
+    return i > 1 && i == n ? i : 0;
+}
+
+int ifelse_skip(struct margs *ma)
+{
+    /*
+     * Decides if the ifelse argument about to be collected can be skipped,
+     * as either an earlier branch has been selected, or it is a branch
+     * whose two comparison arguments differ.
+     */
+    size_t k = ma->act_arg, i;
+    for (i = 1; i + 2 < k; i += 3)
+        if (!rear_buf_rear_buf_cmp(*(ma->args + i), *(ma->args + i + 1)))
+            return 1;
+    if (i + 2 == k)
+        return rear_buf_rear_buf_cmp(*(ma->args + i), *(ma->args + i + 1));
+    return 0;
+}
+
+int ifdef_skip(struct mdef *md, struct margs *ma)
+{
+    /*
+     * Decides if the ifdef argument about to be collected can be skipped,
+     * as it is the branch not taken, or an excess argument.
+     */
+    int bi;
+    int def = AU(*(ma->args + 1))
+        && token_search(md, *(ma->args + 1), &bi) != NULL;
+    if (ma->act_arg == 2)
+        return !def;
+    if (ma->act_arg == 3)
+        return def;
+    return 1;
+}
+
+int close_file_div(struct file_div *f)
+{
+    /* Flushes and closes a named file diversion */
+    int ret = 0;
+    if (f->rb == NULL)
+        return 0;
+    if (flush_rear_buf(f->rb))
+        ret = 1;
+    if (close(f->rb->fd))
+        ret = 1;
+    free_rear_buf(f->rb);
+    f->rb = NULL;
+    return ret;
+}
+
+struct file_div *open_file_div(struct file_div **fdl, char *fn,
+                               size_t * num_open)
+{
+    /*
+     * Returns the named file diversion for fn, ready to write to, moving it
+     * to the head of the list. It is created if it does not exist yet.
+     * The file is truncated the first time it is opened, and appended to
+     * after that. If too many files are open, then the least recently used
+     * open file is closed first.
+     */
+    struct file_div *t = *fdl, *prev = NULL, *lru = NULL;
+    int fd;
+
+    while (t != NULL && strcmp(t->fn, fn)) {
+        prev = t;
+        t = t->next;
+    }
+
+    if (t == NULL) {
+        if ((t = malloc(sizeof(struct file_div))) == NULL)
+            return NULL;
+        if ((t->fn = malloc(strlen(fn) + 1)) == NULL) {
+            free(t);
+            return NULL;
+        }
+        strcpy(t->fn, fn);
+        t->rb = NULL;
+        t->opened = 0;
+    } else if (prev != NULL) {
+        prev->next = t->next;
+    }
+    if (t != *fdl) {
+        t->next = *fdl;
+        *fdl = t;
+    }
+
+    if (t->rb != NULL)
+        return t;
+
+    if (*num_open == MAX_OPEN_FILES) {
+        for (prev = t->next; prev != NULL; prev = prev->next)
+            if (prev->rb != NULL)
+                lru = prev;
+        if (close_file_div(lru))
+            return NULL;
+        --*num_open;
+    }
+
+    if ((t->rb = init_rear_buf(OUT_BLOCK)) == NULL)
+        return NULL;
+    if ((fd = open(fn, O_WRONLY | O_CREAT | O_BINARY
+                   | (t->opened ? O_APPEND : O_TRUNC), 0666)) == -1) {
+        free_rear_buf(t->rb);
+        t->rb = NULL;
+        return NULL;
+    }
+    t->rb->fd = fd;
+    t->opened = 1;
+    ++*num_open;
+    return t;
+}
+
+int close_file_divs(struct file_div *fdl)
+{
+    /* Flushes and closes all named file diversions */
+    int ret = 0;
+    for (; fdl != NULL; fdl = fdl->next)
+        if (close_file_div(fdl))
+            ret = 1;
+    return ret;
+}
+
+void free_file_divs(struct file_div *fdl)
+{
+    /* Frees the named file diversion list, closing any open files */
+    struct file_div *next;
+    while (fdl != NULL) {
+        next = fdl->next;
+        if (fdl->rb != NULL) {
+            close(fdl->rb->fd);
+            free_rear_buf(fdl->rb);
+        }
+        free(fdl->fn);
+        free(fdl);
+        fdl = next;
+    }
+}
+
+int copy_file_to_block(struct rear_buf *dest, int in, size_t fs)
+{
+    /*
+     * Copies fs bytes from the file descriptor in to the file descriptor of
+     * a fixed-size block, which must have been flushed first. On Linux the
+     * copy is done in the kernel (copy_file_range for a file, or sendfile
+     * which also works for a pipe). Otherwise, the file is read into the
+     * block, which is flushed each time it fills up.
+     */
+    int r;
+#ifdef __linux__
+    ssize_t n;
+    while (fs) {
+        if ((n = copy_file_range(in, NULL, dest->fd, NULL, fs, 0)) == -1
+            && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        fs -= n;
+    }
+    while (fs) {
+        if ((n = sendfile(dest->fd, in, NULL, fs)) == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        fs -= n;
+    }
+#endif
+    while (fs) {
+        if (!dest->gs && flush_rear_buf(dest))
+            return 1;
+        if ((r = read(in, dest->p + TEXTSIZE(dest),
+                      dest->gs < fs ? dest->gs : fs)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        /* File has shrunk */
+        if (!r)
+            return 1;
+        dest->gs -= r;
+        fs -= r;
+    }
+    return 0;
+}
+
+int undivert_file(struct rear_buf *dest, char *fn)
+{
+    /*
+     * Appends a file verbatim onto the end of a diversion buffer, without
+     * it going through the input (so it is not scanned for macros). If the
+     * destination is a fixed-size block that writes to a file descriptor,
+     * then the block is flushed and the file is copied straight to the
+     * file descriptor. Otherwise, the file is read directly into the gap
+     * of the destination.
+     */
+    int ret = 0;
+    int in, r;
+    size_t fs;
+    if (filesize(fn, &fs))
+        return 1;
+    if (!fs)
+        return 0;
+    if ((in = open(fn, O_RDONLY | O_BINARY)) == -1)
+        return 1;
+    if (dest->fd != -1) {
+        if (flush_rear_buf(dest) || copy_file_to_block(dest, in, fs))
+            ret = 1;
+    } else if (dest->gs < fs && grow_rear_buf(dest, fs)) {
+        ret = 1;
+    } else {
+        while (fs) {
+            /* Reads are limited so that the size fits in an int */
+            if ((r = read(in, dest->p + TEXTSIZE(dest),
+                          fs > INT_MAX ? INT_MAX : fs)) == -1
+                && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                ret = 1;
+                break;
+            }
+            dest->gs -= r;
+            fs -= r;
+        }
+    }
+    if (close(in))
+        ret = 1;
+    return ret;
+}
+
 int divnum_index(struct rear_buf *rb, size_t * index)
 {
     /* Converts a divnum text to a divnum index */
@@ -826,6 +1549,24 @@ int divnum_index(struct rear_buf *rb, size_t * index)
     return 1;
 }
 
+int str_to_size(char *str, size_t * x)
+{
+    /* Converts a string of decimal digits to a size_t */
+    size_t n = 0;
+    if (!*str)
+        return 1;
+    while (*str) {
+        if (!isdigit((unsigned char) *str))
+            return 1;
+        if (MOF(n, 10) || AOF(n * 10, (size_t) (*str - '0')))
+            return 1;
+        n = n * 10 + *str - '0';
+        ++str;
+    }
+    *x = n;
+    return 0;
+}
+
 char *rear_buf_to_str(struct rear_buf *rb)
 {
     /*
@@ -936,37 +1677,81 @@ int main(int argc, char **argv)
     struct front_buf *input;
     struct rear_buf *token = NULL;
     struct rear_buf *output;    /* This is a shortcut to the changing output */
-    /* Diversion output buffers 0 to 9 and -1. Diversion -1 maps to index 10 */
-    struct rear_buf *div[NUM_DIVS];
+    /*
+     * Diversion output buffers 0 to 9 and -1. Diversion -1 maps to index 10.
+     * Index 11 (DIV_FILE) points to the block of the active named file
+     * diversion, which is the head of the file diversion list.
+     */
+    struct rear_buf *div[NUM_DIVS + 1];
+    struct file_div *fdl = NULL;        /* Named file diversions */
+    size_t num_open = 0;        /* Number of open named file diversions */
     size_t act_div = 0;         /* Active diversion */
     size_t tmp_index;           /* Temporary divnum index */
     int end_of_input = 0;       /* Indicates when the input is empty (like EOF) */
     int quote_on = 0;
     size_t quote_depth = 0;
     struct margs *ma = NULL;    /* Stack */
+    struct margs *spare = NULL; /* Stack nodes kept for reuse */
+    size_t max_depth = DEF_MAX_DEPTH;   /* Maximum stack depth (0 is no limit) */
+    size_t max_growth = DEF_MAX_GROWTH; /* Maximum input growth (0 is no limit) */
+    int first_file;             /* Index in argv of the first file */
     struct mdef *md = NULL;     /* Macro definitions */
+    struct mdef *md_node;       /* Macro definition being redefined */
     struct mem *text_mem;
     int bi;                     /* Built-in identifier of matched macro */
     /*
      * Result after arguments are substituted into macro definition
      * (before being pushed back into the input to be rescanned).
      */
-    struct rear_buf *result;
+    struct rear_buf *result = NULL;
     size_t s;                   /* Temp size variable */
     char *tmp_str;              /* Temporary string */
     int last_match = 0;         /* Last token read was a macro match */
     int eat_whitespace = 0;     /* Eat input whitespace */
-    char left_quote = '`';      /* Left quote: default is backtick */
-    char right_quote = '\'';    /* Right quote: default is single quote */
-    int trace = 0;              /* Indicates if trace is on */
+    struct delim dl;            /* Quote and comment delimiters */
+    int type;                   /* Delimiter identifier of the token */
+    int comment_on = 0;         /* Indicates if inside a comment */
+    int trace_all = 0;          /* Trace all macros */
+    struct mdef *tn = NULL;     /* Names of the traced macros */
+    size_t trace_depth = 0;     /* Maximum traced stack depth (0 is no limit) */
+    char *trace_fn = NULL;      /* Trace file (default is stderr) */
+    struct rear_buf *tb = NULL; /* Trace output block */
+    int err = 0;
     int i;
     size_t j;
-    char *q;
 
     if (argc < 1)
         return 1;
 
-    if (argc == 1) {
+    for (i = 0; i < NUM_DELIMS; ++i) {
+        dl.d[i].p = NULL;
+        dl.d[i].s = 0;
+    }
+
+    /* Options */
+    for (i = 1; i < argc && **(argv + i) == '-'; i += 2) {
+        if (i + 1 == argc)
+            err = 1;
+        else if (!strcmp(*(argv + i), "-L"))
+            err = str_to_size(*(argv + i + 1), &max_depth);
+        else if (!strcmp(*(argv + i), "-M"))
+            err = str_to_size(*(argv + i + 1), &max_growth);
+        else if (!strcmp(*(argv + i), "-d"))
+            err = str_to_size(*(argv + i + 1), &trace_depth);
+        else if (!strcmp(*(argv + i), "-o"))
+            trace_fn = *(argv + i + 1);
+        else if (strcmp(*(argv + i), "-t"))
+            err = 1;
+        if (err) {
+            fprintf(stderr, "Usage: %s [-L max_depth] [-M max_growth] "
+                    "[-t macro_name] [-d trace_depth] [-o trace_file] "
+                    "[file ...]\n", *argv);
+            return 1;
+        }
+    }
+    first_file = i;
+
+    if (first_file == argc) {
         if ((tmp = init_rear_buf(LARGEGAP)) == NULL)
             return 1;
         if (read_stdin(tmp)) {
@@ -988,7 +1773,7 @@ int main(int argc, char **argv)
         }
         free_rear_buf(tmp);
     } else {
-        for (i = 1; i < argc; ++i) {
+        for (i = first_file; i < argc; ++i) {
             if (filesize(*(argv + i), &fs))
                 return 1;
             total_fs += fs;
@@ -997,7 +1782,7 @@ int main(int argc, char **argv)
             return 1;
         if ((input = init_front_buf(LARGEGAP + total_fs)) == NULL)
             return 1;
-        for (i = argc - 1; i; --i) {
+        for (i = argc - 1; i >= first_file; --i) {
             if (insert_file(input, *(argv + i))) {
                 free_front_buf(input);
                 return 1;
@@ -1005,13 +1790,22 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Limit the growth of the input from macro expansion */
+    if (max_growth)
+        input->max = AOF(TEXTSIZE(input), max_growth) ? SIZE_MAX
+            : TEXTSIZE(input) + max_growth;
+
     /* Setup diversion output buffers */
+    for (j = 0; j < NUM_DIVS + 1; ++j)
+        *(div + j) = NULL;
     for (j = 0; j < NUM_DIVS; ++j) {
-        if ((*(div + j) = init_rear_buf(LARGEGAP)) == NULL) {
+        if ((*(div + j) = init_rear_buf(j ? DIVGAP : OUT_BLOCK)) == NULL) {
             ret = 1;
             goto clean_up;
         }
     }
+    /* Diversion 0 is a fixed-size block that writes through to stdout */
+    (*div)->fd = 1;
 
     /* Set output shortcut to active diversion  */
     output = *(div + act_div);
@@ -1027,11 +1821,46 @@ int main(int argc, char **argv)
      * the arguments into the macro definition
      * (before being pushed back into the input to be rescanned).
      */
-    if ((result = init_rear_buf(LARGEGAP)) == NULL) {
+    if ((result = init_rear_buf(DIVGAP)) == NULL) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    /*
+     * Setup the trace block. Trace records are buffered and written to the
+     * trace file, or stderr, a block at a time.
+     */
+    if ((tb = init_rear_buf(OUT_BLOCK)) == NULL) {
+        ret = 1;
+        goto clean_up;
+    }
+    if (trace_fn == NULL) {
+        tb->fd = 2;
+    } else if ((tb->fd = open(trace_fn, O_WRONLY | O_CREAT | O_TRUNC
+                              | O_BINARY, 0666)) == -1) {
+        fprintf(stderr, "%s: Cannot open trace file: %s\n", *argv,
+                trace_fn);
         ret = 1;
         goto clean_up;
     }
 
+    /* Trace the macro names given on the command line */
+    for (i = 1; i < first_file; i += 2) {
+        if (!strcmp(*(argv + i), "-t")
+            && stack_on_mdef(&tn, *(argv + i + 1),
+                             strlen(*(argv + i + 1)))) {
+            ret = 1;
+            goto clean_up;
+        }
+    }
+
+    /* Default quotes are the backtick and single quote, comments are off */
+    if (set_delim(&dl, DL_LQ, "`", 1) || set_delim(&dl, DL_RQ, "'", 1)) {
+        ret = 1;
+        goto clean_up;
+    }
+    compile_delims(&dl);
+
     /* Do not need to setup the stack, it is created on demand */
 
     /*
@@ -1127,15 +1956,48 @@ int main(int argc, char **argv)
         goto clean_up;
     }
 
+    /* Add the changecom built-in macro */
+    if (add_built_in_macro(&md, "changecom", BI_CHANGECOM)) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    /* Add the divfile built-in macro */
+    if (add_built_in_macro(&md, "divfile", BI_DIVFILE)) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    /* Add the pushdef built-in macro */
+    if (add_built_in_macro(&md, "pushdef", BI_PUSHDEF)) {
+        ret = 1;
+        goto clean_up;
+    }
 
-    /* The m4 loop */
-    while (!read_token(input, token, &end_of_input)) {
+    /* Add the popdef built-in macro */
+    if (add_built_in_macro(&md, "popdef", BI_POPDEF)) {
+        ret = 1;
+        goto clean_up;
+    }
+
+
+    /*
+     * The m4 loop.
+     * Inside a comment only the end of comment is recognised, inside quotes
+     * only the quotes are recognised, otherwise the left quote and the start
+     * of comment are recognised.
+     */
+    while (!read_token(input, token, &end_of_input, &dl,
+                       comment_on ? DL_BIT(DL_ECOM)
+                       : quote_on ? DL_BIT(DL_LQ) | DL_BIT(DL_RQ)
+                       : DL_BIT(DL_LQ) | DL_BIT(DL_SCOM), &type)) {
         /*
          * How m4 works
          * ============
          * Nothing is interpreted when quotes are on, except that
          * the quote depth is recorded, so that it can be known
-         * when to exit quote mode.
+         * when to exit quote mode. Comments are copied to the output
+         * uninterpreted, including the delimiters.
          * The quote information can be global (separate to the stack node)
          * as quotes must be off in order to enter a stack node.
          * The unquoted-backet depth must be recorded at a local stack node
@@ -1165,12 +2027,23 @@ int main(int argc, char **argv)
          * into another diversion before the program finishes.
          */
 
-        if (trace) {
-            fprintf(stderr, "Token: ");
-            print_token(token);
-        }
-
-        if (!rear_buf_char_cmp(token, left_quote)) {
+        if (comment_on) {
+            /* Inside a comment, so just copy TOKEN TO OUTPUT */
+            if (rear_buf_append_rear_buf(output, token)) {
+                ret = 1;
+                goto clean_up;
+            }
+            if (type == DL_ECOM)
+                comment_on = 0;
+        } else if (type == DL_SCOM && !last_match) {
+            /* START OF COMMENT, which is copied to the output */
+            if (rear_buf_append_rear_buf(output, token)) {
+                ret = 1;
+                goto clean_up;
+            }
+            comment_on = 1;
+            eat_whitespace = 0;
+        } else if (type == DL_LQ && !last_match) {
             /* TURN ON QUOTE mode if off */
             if (!quote_on)
                 quote_on = 1;
@@ -1183,7 +2056,7 @@ int main(int argc, char **argv)
             ++quote_depth;
             eat_whitespace = 0;
             last_match = 0;
-        } else if (!rear_buf_char_cmp(token, right_quote)) {
+        } else if (type == DL_RQ) {
             /*
              * TURN OFF QUOTE mode if exited from nested quotes
              * (the depth must be zero afterwards)
@@ -1206,12 +2079,12 @@ int main(int argc, char **argv)
                 /* Decrement unquoted backet depth to zero */
                 --ma->bracket_depth;
 
-                /* If trace is on, then dump the stack */
-                if (trace)
-                    if (dump_stack(ma)) {
-                        ret = 1;
-                        goto clean_up;
-                    }
+                /* Write a trace record if the call is traced */
+                if (traced(ma, trace_all, tn, trace_depth)
+                    && trace_call(tb, ma, 1)) {
+                    ret = 1;
+                    goto clean_up;
+                }
 
                 /* Check for BUILT-IN MACROS */
 
@@ -1219,41 +2092,57 @@ int main(int argc, char **argv)
                  * THE define MACRO. To define a macro it must start
                  * with a letter or an underscore.
                  */
-                if (ma->built_in == BI_DEFINE && AU(*(ma->args + 1))) {
-                    /* Undefine the macro if it is already defined */
-                    undefine_macro(&md, *(ma->args + 1));
-
-                    /* Make a new mdef head */
-                    if (stack_on_mdef(&md)) {
-                        ret = 1;
-                        goto clean_up;
-                    }
-                    /* Copy the user defined macro name */
-                    s = TEXTSIZE(*(ma->args + 1));
-                    if ((md->name.p = malloc(s)) == NULL) {
+                if ((ma->built_in == BI_DEFINE || ma->built_in == BI_PUSHDEF)
+                    && AU(*(ma->args + 1))) {
+                    /*
+                     * Redefine the macro in place if it is already defined,
+                     * otherwise make a new mdef head.
+                     * THE pushdef MACRO is the same, except that the old
+                     * definition is pushed onto the definition stack first.
+                     */
+                    if ((md_node = mdef_search(md, *(ma->args + 1))) == NULL) {
+                        if (stack_on_mdef(&md, (*(ma->args + 1))->p,
+                                          TEXTSIZE(*(ma->args + 1)))) {
+                            ret = 1;
+                            goto clean_up;
+                        }
+                        md_node = md;
+                    } else if (ma->built_in == BI_PUSHDEF
+                               && push_mdef(md_node)) {
                         ret = 1;
                         goto clean_up;
                     }
-                    memcpy(md->name.p, (*(ma->args + 1))->p, s);
-                    md->name.s = s;
-                    md->built_in = 0;   /* User defined */
+                    md_node->built_in = 0;      /* User defined */
                     /* Copy the user defined macro replacement text */
-                    s = TEXTSIZE(*(ma->args + 2));
-                    if ((md->text.p = malloc(s)) == NULL) {
+                    if (mem_set(&md_node->text, &md_node->text_cap,
+                                (*(ma->args + 2))->p,
+                                TEXTSIZE(*(ma->args + 2)))) {
                         ret = 1;
                         goto clean_up;
                     }
-                    memcpy(md->text.p, (*(ma->args + 2))->p, s);
-                    md->text.s = s;
 
                 } else if (ma->built_in == BI_UNDEFINE) {
                     /* THE undefine MACRO */
-                    for (j = 0; j < MAXARGS; ++j) {
+                    /* Arg 0 is the macro name */
+                    for (j = 1; j < MAXARGS; ++j) {
                         if (AU(*(ma->args + j))) {
                             /* Undefine the macro if it is already defined */
                             undefine_macro(&md, *(ma->args + j));
                         }
                     }
+                } else if (ma->built_in == BI_POPDEF) {
+                    /* THE popdef MACRO */
+                    for (j = 1; j < MAXARGS; ++j) {
+                        if (AU(*(ma->args + j))
+                            && (md_node =
+                                mdef_search(md, *(ma->args + j))) != NULL) {
+                            /* Remove the macro if it is the last definition */
+                            if (md_node->below == NULL)
+                                undefine_macro(&md, *(ma->args + j));
+                            else
+                                pop_mdef(md_node);
+                        }
+                    }
                 } else if (ma->built_in == BI_DIVERT) {
                     /* THE divert MACRO */
                     if (divnum_index(*(ma->args + 1), &act_div)) {
@@ -1264,17 +2153,51 @@ int main(int argc, char **argv)
                         goto clean_up;
                     }
                     /* No need to refresh the output shortcut as this will happen later */
+                } else if (ma->built_in == BI_DIVFILE) {
+                    /* THE divfile MACRO */
+                    /* Convert arg 1 into the filename */
+                    if ((tmp_str =
+                         rear_buf_to_str(*(ma->args + 1))) == NULL) {
+                        ret = 1;
+                        goto clean_up;
+                    }
+                    if (!*tmp_str
+                        || open_file_div(&fdl, tmp_str, &num_open) == NULL) {
+                        fprintf(stderr,
+                                "%s: divfile: failed to open file: %s\n",
+                                *argv, tmp_str);
+                        free(tmp_str);
+                        ret = 1;
+                        goto clean_up;
+                    }
+                    free(tmp_str);
+                    *(div + DIV_FILE) = fdl->rb;
+                    act_div = DIV_FILE;
+                    /* No need to refresh the output shortcut as this will happen later */
                 } else if (ma->built_in == BI_UNDIVERT) {
                     for (j = 1; j < MAXARGS; ++j) {
                         /* THE undivert MACRO */
                         /* Skip empty arguments */
                         if (TEXTSIZE(*(ma->args + j))) {
                             if (divnum_index(*(ma->args + j), &tmp_index)) {
-                                fprintf(stderr,
-                                        "%s: undivert: Invalid divnum supplied at argument: %lu\n",
-                                        *argv, (unsigned long) j);
-                                ret = 1;
-                                goto clean_up;
+                                /* Not a divnum, so copy the file verbatim */
+                                if ((tmp_str =
+                                     rear_buf_to_str(*(ma->args + j))) ==
+                                    NULL) {
+                                    ret = 1;
+                                    goto clean_up;
+                                }
+                                if (undivert_file
+                                    (*(div + act_div), tmp_str)) {
+                                    fprintf(stderr,
+                                            "%s: undivert: failed to copy file: %s\n",
+                                            *argv, tmp_str);
+                                    free(tmp_str);
+                                    ret = 1;
+                                    goto clean_up;
+                                }
+                                free(tmp_str);
+                                continue;
                             }
                             /* Cannot undivert the active diversion into itself */
                             if (tmp_index == act_div) {
@@ -1297,20 +2220,42 @@ int main(int argc, char **argv)
                     }
                 } else if (ma->built_in == BI_CHANGEQUOTE) {
                     /* THE changequote MACRO */
-                    /* The quotes must be different, single, graph characters */
-                    if (TEXTSIZE(*(ma->args + 1)) != 1
-                        || TEXTSIZE(*(ma->args + 2)) != 1
-                        || !isgraph(*(*(ma->args + 1))->p)
-                        || !isgraph(*(*(ma->args + 2))->p)
-                        || *(*(ma->args + 1))->p == *(*(ma->args + 2))->p) {
+                    /* The quotes must be different and not empty */
+                    if (!TEXTSIZE(*(ma->args + 1))
+                        || !TEXTSIZE(*(ma->args + 2))
+                        || !rear_buf_rear_buf_cmp(*(ma->args + 1),
+                                                  *(ma->args + 2))) {
                         fprintf(stderr,
                                 "%s: changequote: Invalid arguments\n",
                                 *argv);
                         ret = 1;
                         goto clean_up;
                     }
-                    left_quote = *(*(ma->args + 1))->p;
-                    right_quote = *(*(ma->args + 2))->p;
+                    if (set_delim(&dl, DL_LQ, (*(ma->args + 1))->p,
+                                  TEXTSIZE(*(ma->args + 1)))
+                        || set_delim(&dl, DL_RQ, (*(ma->args + 2))->p,
+                                     TEXTSIZE(*(ma->args + 2)))) {
+                        ret = 1;
+                        goto clean_up;
+                    }
+                    compile_delims(&dl);
+
+                } else if (ma->built_in == BI_CHANGECOM) {
+                    /* THE changecom MACRO */
+                    /*
+                     * An empty start of comment turns comments off.
+                     * The end of comment defaults to a newline.
+                     */
+                    if (set_delim(&dl, DL_SCOM, (*(ma->args + 1))->p,
+                                  TEXTSIZE(*(ma->args + 1)))
+                        || (TEXTSIZE(*(ma->args + 2))
+                            ? set_delim(&dl, DL_ECOM, (*(ma->args + 2))->p,
+                                        TEXTSIZE(*(ma->args + 2)))
+                            : set_delim(&dl, DL_ECOM, "\n", 1))) {
+                        ret = 1;
+                        goto clean_up;
+                    }
+                    compile_delims(&dl);
 
                 } else if (ma->built_in == BI_INCLUDE) {
                     /* THE include MACRO */
@@ -1385,30 +2330,21 @@ int main(int argc, char **argv)
                 } else if (ma->built_in == BI_IFELSE) {
                     /* THE ifelse MACRO */
                     /* Empty arguments compare equal */
-                    if ((*(ma->args + 1))->s == (*(ma->args + 2))->s
-                        && !memcmp((*(ma->args + 1))->p,
-                                   (*(ma->args + 2))->p,
-                                   (*(ma->args + 1))->s)) {
-                        /* Arg 1 and 2 are equal */
-                        /* Push arg 3 into input */
-                        if (TEXTSIZE(*(ma->args + 3))
-                            && insert_rear_in_front_buf(input,
-                                                        *(ma->args + 3))) {
-                            ret = 1;
-                            goto clean_up;
-                        }
-                    } else {
-                        /* Push arg 4 into input */
-                        if (TEXTSIZE(*(ma->args + 4))
-                            && insert_rear_in_front_buf(input,
-                                                        *(ma->args + 4))) {
-                            ret = 1;
-                            goto clean_up;
-                        }
+                    /* Push the selected argument into input */
+                    if ((j = ifelse_branch(ma))
+                        && TEXTSIZE(*(ma->args + j))
+                        && insert_rear_in_front_buf(input, *(ma->args + j))) {
+                        ret = 1;
+                        goto clean_up;
                     }
 
                 } else if (ma->built_in == BI_DUMPDEF) {
                     /* THE dumpdef MACRO */
+                    /* Keep the trace in order with the other stderr output */
+                    if (tb->fd == 2 && flush_rear_buf(tb)) {
+                        ret = 1;
+                        goto clean_up;
+                    }
                     for (j = 1; j < MAXARGS; ++j) {
                         if (TEXTSIZE(*(ma->args + j))) {
                             /* Write ONE macro name to stderr */
@@ -1447,8 +2383,31 @@ int main(int argc, char **argv)
                             }
                         }
                     }
+                } else if (ma->built_in == BI_TRACEON) {
+                    /* THE traceon MACRO */
+                    /* Add the macro names to the trace list */
+                    for (j = 1; j < MAXARGS; ++j) {
+                        if (AU(*(ma->args + j))
+                            && mdef_search(tn, *(ma->args + j)) == NULL
+                            && stack_on_mdef(&tn, (*(ma->args + j))->p,
+                                             TEXTSIZE(*(ma->args + j)))) {
+                            ret = 1;
+                            goto clean_up;
+                        }
+                    }
+                } else if (ma->built_in == BI_TRACEOFF) {
+                    /* THE traceoff MACRO */
+                    /* Remove the macro names from the trace list */
+                    for (j = 1; j < MAXARGS; ++j)
+                        if (AU(*(ma->args + j)))
+                            undefine_macro(&tn, *(ma->args + j));
                 } else if (ma->built_in == BI_ERRPRINT) {
                     /* THE errprint MACRO */
+                    /* Keep the trace in order with the other stderr output */
+                    if (tb->fd == 2 && flush_rear_buf(tb)) {
+                        ret = 1;
+                        goto clean_up;
+                    }
                     /* Write arguments to stderr */
                     for (j = 1; j < MAXARGS; ++j) {
                         s = TEXTSIZE(*(ma->args + j));
@@ -1479,7 +2438,7 @@ int main(int argc, char **argv)
                     }
                 }
                 /* Remove stack head */
-                delete_margs_stack_head(&ma);
+                delete_margs_stack_head(&ma, &spare);
 
                 /* Repoint output shortcut */
                 if (ma == NULL) {
@@ -1524,6 +2483,13 @@ int main(int argc, char **argv)
             } else if (last_match && ma != NULL
                        && rear_buf_char_cmp(token, '(')) {
                 /* Macro called with NO BRACKETS (no arguments) */
+                /* Write a trace record if the call is traced */
+                if (traced(ma, trace_all, tn, trace_depth)
+                    && trace_call(tb, ma, 0)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+
                 /* Process built-in macro that take no arguments first */
                 if (ma->built_in == BI_DIVNUM) {
                     /* THE divnum MACRO */
@@ -1532,7 +2498,13 @@ int main(int argc, char **argv)
                         ret = 1;
                         goto clean_up;
                     }
-                    if (act_div != 10) {
+                    if (act_div == DIV_FILE) {
+                        /* Push back the filename of the named file diversion */
+                        if (insert_str_in_front_buf(input, fdl->fn)) {
+                            ret = 1;
+                            goto clean_up;
+                        }
+                    } else if (act_div != 10) {
                         /* Push back into input to be rescanned later */
                         if (insert_ch_in_front_buf(input, '0' + act_div)) {
                             ret = 1;
@@ -1557,13 +2529,8 @@ int main(int argc, char **argv)
                         ret = 1;
                         goto clean_up;
                     }
-                    /* Search for newline character */
-                    if ((q =
-                         memchr(input->p + input->gs, '\n',
-                                input->s - input->gs)) != NULL) {
-                        /* Delete up to and including the newline character */
-                        input->gs = q - input->p + 1;
-                    }
+                    /* Delete up to and including the newline character */
+                    skip_to_newline(input);
 
                 } else if (ma->built_in == BI_DIVERT) {
                     /* THE divert MACRO  -- No brackets (arguments) */
@@ -1576,7 +2543,7 @@ int main(int argc, char **argv)
                     for (j = 0; j < NUM_NON_NEG_DIVS; ++j) {
                         /* Undivert into the active diversion (does not change the active diversion index) */
                         if (j != act_div && undivert
-                            (*(div + act_div), *(div + tmp_index))) {
+                            (*(div + act_div), *(div + j))) {
                             ret = 1;
                             goto clean_up;
                         }
@@ -1584,10 +2551,28 @@ int main(int argc, char **argv)
                 } else if (ma->built_in == BI_CHANGEQUOTE) {
                     /* THE changequote MACRO -- No brackets (arguments) */
                     /* Restore default quotes */
-                    left_quote = '`';
-                    right_quote = '\'';
+                    if (set_delim(&dl, DL_LQ, "`", 1)
+                        || set_delim(&dl, DL_RQ, "'", 1)) {
+                        ret = 1;
+                        goto clean_up;
+                    }
+                    compile_delims(&dl);
+                } else if (ma->built_in == BI_CHANGECOM) {
+                    /* THE changecom MACRO -- No brackets (arguments) */
+                    /* Turn comments off */
+                    if (set_delim(&dl, DL_SCOM, NULL, 0)
+                        || set_delim(&dl, DL_ECOM, NULL, 0)) {
+                        ret = 1;
+                        goto clean_up;
+                    }
+                    compile_delims(&dl);
                 } else if (ma->built_in == BI_DUMPDEF) {
                     /* THE dumpdef MACRO -- No brackets (arguments) */
+                    /* Keep the trace in order with the other stderr output */
+                    if (tb->fd == 2 && flush_rear_buf(tb)) {
+                        ret = 1;
+                        goto clean_up;
+                    }
                     /* Write ALL macros to stderr */
                     if (dumpdef_all(md)) {
                         ret = 1;
@@ -1595,10 +2580,14 @@ int main(int argc, char **argv)
                     }
                 } else if (ma->built_in == BI_TRACEON) {
                     /* THE traceon MACRO -- No brackets (arguments) */
-                    trace = 1;
+                    /* Trace all macros */
+                    trace_all = 1;
                 } else if (ma->built_in == BI_TRACEOFF) {
                     /* THE traceoff MACRO -- No brackets (arguments) */
-                    trace = 0;
+                    /* Stop all tracing */
+                    trace_all = 0;
+                    free_mdef_linked_list(tn);
+                    tn = NULL;
                 } else {
                     /* USER DEFINED MACRO WITH NO ARGUMENT BRACKETS */
                     /* Put the token back on the input */
@@ -1610,13 +2599,6 @@ int main(int argc, char **argv)
                     /* Clear out result buffer */
                     DELETEBUF(result);
 
-                    /* If trace is on, then dump the stack */
-                    if (trace)
-                        if (dump_stack(ma)) {
-                            ret = 1;
-                            goto clean_up;
-                        }
-
                     /*
                      * Substitute arguments into definition.
                      * No arguments have been collected, but this is still
@@ -1636,7 +2618,7 @@ int main(int argc, char **argv)
                 }
 
                 /* Remove stack head */
-                delete_margs_stack_head(&ma);
+                delete_margs_stack_head(&ma, &spare);
 
                 /* Repoint output shortcut */
                 if (ma == NULL) {
@@ -1663,6 +2645,13 @@ int main(int argc, char **argv)
                 }
                 /* Refresh output shortcut */
                 output = *(ma->args + ma->act_arg);
+                /*
+                 * Branches of ifelse and ifdef that will not be taken are
+                 * skipped over without being expanded.
+                 */
+                if ((ma->built_in == BI_IFELSE && ifelse_skip(ma))
+                    || (ma->built_in == BI_IFDEF && ifdef_skip(md, ma)))
+                    skip_arg(input, &dl);
                 eat_whitespace = 1;
                 last_match = 0;
             } else if (AU(token)
@@ -1678,13 +2667,29 @@ int main(int argc, char **argv)
                  * Create a new stack node and copy the text.
                  * The active argument will be set to zero.
                  */
-                if (stack_on_margs(&ma)) {
+                if (stack_on_margs(&ma, &spare)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+
+                /* Record the macro name */
+                if (rear_buf_append_rear_buf(*ma->args, token)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+
+                if (max_depth && ma->depth > max_depth) {
+                    fprintf(stderr,
+                            "%s: Macro nesting depth exceeds %lu\n",
+                            *argv, (unsigned long) max_depth);
+                    print_macro_chain(ma);
                     ret = 1;
                     goto clean_up;
                 }
 
                 /* Copy definition (as this may change later */
-                if (mem_to_mem_cpy(&ma->text, text_mem)) {
+                if (mem_set(&ma->text, &ma->text_cap, text_mem->p,
+                            text_mem->s)) {
                     ret = 1;
                     goto clean_up;
                 }
@@ -1698,19 +2703,12 @@ int main(int argc, char **argv)
                 last_match = 1;
 
             } else {
-                /* EAT WHITESPACE */
-                if (eat_whitespace && (!rear_buf_char_cmp(token, ' ')
-                                       || !rear_buf_char_cmp(token, '\t')
-                                       || !rear_buf_char_cmp(token, '\n')
-                                       || !rear_buf_char_cmp(token, '\r'))) {
-                    /* Do nothing */
-                } else {
-                    eat_whitespace = 0;
-                    /* Copy TOKEN TO OUTPUT */
-                    if (rear_buf_append_rear_buf(output, token)) {
-                        ret = 0;
-                        goto clean_up;
-                    }
+                /* Whitespace has already been eaten in bulk (see below) */
+                eat_whitespace = 0;
+                /* Copy TOKEN TO OUTPUT */
+                if (rear_buf_append_rear_buf(output, token)) {
+                    ret = 0;
+                    goto clean_up;
                 }
                 last_match = 0;
             }
@@ -1721,22 +2719,63 @@ int main(int argc, char **argv)
                 goto clean_up;
             }
         }
+
+        /*
+         * EAT WHITESPACE. The whole run is deleted from the input at once,
+         * rather than one token at a time. Whitespace straight after a macro
+         * name is not eaten, as it ends an argument-less call.
+         */
+        if (eat_whitespace && !last_match && !quote_on && !comment_on)
+            skip_whitespace(input, &dl, DL_BIT(DL_LQ) | DL_BIT(DL_SCOM));
     }
 
-    /* Write diversions to stdout in ascending order (excluding diversion -1) */
-    for (j = 0; j < NUM_NON_NEG_DIVS; ++j) {
-        s = TEXTSIZE(*(div + j));
-        if (s && fwrite((*(div + j))->p, 1, s, stdout) != s) {
+    /*
+     * Write diversions to stdout in ascending order (excluding diversion -1).
+     * Diversion 0 has been written through as it went, so only the tail
+     * of its block is left to flush.
+     */
+    if (flush_rear_buf(*div)) {
+        ret = 1;
+        goto clean_up;
+    }
+    for (j = 1; j < NUM_NON_NEG_DIVS; ++j) {
+        if (write_all(1, (*(div + j))->p, TEXTSIZE(*(div + j)))) {
             ret = 1;
             goto clean_up;
         }
     }
 
+    /* Flush and close the named file diversions */
+    if (close_file_divs(fdl)) {
+        ret = 1;
+        goto clean_up;
+    }
+
   clean_up:
+    if (tb != NULL) {
+        if (tb->fd != -1 && flush_rear_buf(tb))
+            ret = 1;
+        if (tb->fd > 2 && close(tb->fd))
+            ret = 1;
+        free_rear_buf(tb);
+    }
+    if (input->over) {
+        fprintf(stderr, "%s: Input growth exceeds %lu bytes\n", *argv,
+                (unsigned long) max_growth);
+        print_macro_chain(ma);
+    }
     if (!end_of_input)
         ret = 1;
     free_front_buf(input);
     free_rear_buf(token);
+    free_rear_buf(result);
+    for (j = 0; j < NUM_DIVS; ++j)
+        free_rear_buf(*(div + j));
     free_margs_linked_list(ma);
+    free_margs_linked_list(spare);
+    free_mdef_linked_list(md);
+    free_mdef_linked_list(tn);
+    free_file_divs(fdl);
+    free_delims(&dl);
     return ret;
 }
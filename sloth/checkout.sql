@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* sloth checkout SQL */
+
+/* The working tree is made of the tracked files, as for a commit */
+delete from sloth_track;
+
+.import .track sloth_track
+
+/* Stat the files */
+delete from sloth_stage;
+
+insert into sloth_stage (fn, sig)
+select fn, stat_sig(fn) from sloth_track;
+
+/* Files with unchanged stat data keep their hash from the index */
+update sloth_stage
+set h = (select b.h from sloth_index as b
+    where b.fn = sloth_stage.fn and b.sig = sloth_stage.sig);
+
+/* Hash the changed files only, nothing is stored */
+.hash
+
+/* Tracked files that do not exist are not in the working tree */
+delete from sloth_stage where h is null;
+
+delete from sloth_non_zero_trap;
+
+/* Will create an error if there is no commit at or before the time */
+insert into sloth_non_zero_trap (x)
+select not exists (select 1 from sloth_commit as a
+    where a.t <= (select b.i from sloth_tmp_int as b));
+
+/* The snapshot to check out */
+create temp table sloth_target (fn text primary key, h text);
+
+insert into sloth_target (fn, h)
+select
+a.fn,
+a.h
+from sloth_file as a
+/* Interval index first, then the exact check */
+where a.id in (select z.id from sloth_file_time as z
+        where z.entry_t <= (select y.i from sloth_tmp_int as y)
+          and z.exit_t > (select x.i from sloth_tmp_int as x))
+    and (select h.i from sloth_tmp_int as h) >= a.entry_t
+    and (select k.i from sloth_tmp_int as k) < a.exit_t;
+
+/*
+ * Only the files that differ from the working tree are written (h is the
+ * new hash) or deleted (h is NULL). Tracked files that differ from the
+ * index, which holds the last commit or checkout, are dirty, and sloth
+ * refuses to lose their changes. done is set once the change is made.
+ */
+create temp table sloth_checkout
+(fn text primary key, h text, tracked integer, dirty integer,
+done integer not null default 0);
+
+insert into sloth_checkout (fn, h, tracked, dirty)
+select
+a.fn,
+a.h,
+b.fn is not null,
+b.fn is not null and c.h is not b.h
+from sloth_target as a
+left join sloth_stage as b on b.fn = a.fn
+left join sloth_index as c on c.fn = a.fn
+where b.h is null or b.h <> a.h;
+
+insert into sloth_checkout (fn, h, tracked, dirty)
+select
+b.fn,
+null,
+1,
+c.h is not b.h
+from sloth_stage as b
+left join sloth_index as c on c.fn = b.fn
+where b.fn not in (select a.fn from sloth_target as a);
+
+.quit
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* sloth checkout SQL, after the files are written */
+
+/*
+ * If the checkout failed partway, the files whose change was not made keep
+ * their tracking and index entries, so that the checkout can be run again.
+ */
+delete from sloth_target
+where fn in (select a.fn from sloth_checkout as a where not a.done);
+
+/* Track the files of the snapshot */
+.output .track
+select fn from sloth_target
+union
+select a.fn from sloth_track as a
+inner join sloth_checkout as b on b.fn = a.fn
+where not b.done
+order by 1;
+.output
+
+/*
+ * Refresh the index. The files that were just written have no stat
+ * signature yet, so they are hashed again at the next commit.
+ */
+delete from sloth_index
+where fn not in (select a.fn from sloth_checkout as a where not a.done);
+
+insert into sloth_index (fn, sig, h)
+select fn, stat_sig(fn), h from sloth_target;
+
+.quit
@@ -16,10 +16,7 @@
 
 /* sloth combine SQL */
 
-SQL_OPTS
-
-/* Attach other database */
-attach database (select a.x from sloth_tmp_text as a) as other;
+/* The other database is attached as other by sloth */
 
 /* Make sure there are no conflicting file paths */
 delete from main.sloth_non_zero_trap;
@@ -32,17 +29,74 @@ from main.sloth_file as a
 where a.fn in (select b.fn from other.sloth_file as b group by b.fn);
 
 /* Load data from other repo into main repo */
-insert into main.sloth_commit
-select * from other.sloth_commit;
+insert into main.sloth_commit (t, msg)
+select t, msg from other.sloth_commit;
+
+/* New ids, which the triggers add to the interval index */
+insert into main.sloth_file (fn, h, entry_t, exit_t)
+select fn, h, entry_t, exit_t from other.sloth_file;
+
+/* Copy the dictionaries, giving them identifiers that are free in main */
+create temp table sloth_dict_map
+(old integer not null unique primary key,
+new integer not null unique
+);
+
+insert into sloth_dict_map (old, new)
+select
+a.id,
+row_number() over (order by a.id asc)
+    + (select max(x) from
+        (select coalesce(max(b.id), 0) as x from main.sloth_dict as b
+        union all
+        select c.seq from main.sqlite_sequence as c
+        where c.name = 'sloth_dict'))
+from other.sloth_dict as a;
 
-insert into main.sloth_file
-select * from other.sloth_file;
+insert into main.sloth_dict (id, d)
+select
+b.new,
+a.d
+from other.sloth_dict as a
+inner join sloth_dict_map as b
+on a.id = b.old;
 
-/* Load unique blobs only */
-insert into main.sloth_blob
-select * from other.sloth_blob as a
+/* Chunk lists of new chunked blobs, the chunks come with the blobs */
+insert into main.sloth_chunk (h, i, chunk_h, s)
+select
+a.h,
+a.i,
+a.chunk_h,
+a.s
+from other.sloth_chunk as a
 where a.h not in (select b.h from main.sloth_blob as b);
 
+/* Load unique blobs only. The bases of deltas are found by hash. */
+insert into main.sloth_blob (h, d, enc, dict_id, base_h, depth)
+select
+a.h,
+a.d,
+a.enc,
+b.new,
+a.base_h,
+a.depth
+from other.sloth_blob as a
+left join sloth_dict_map as b
+on a.dict_id = b.old
+where a.h not in (select c.h from main.sloth_blob as c);
+
+drop table sloth_dict_map;
+
+/* The snapshots of all commits now include the files of both repos */
+update main.sloth_commit set root_h = null;
+
+.roots
+
+/* The history has been rewritten, so the next export starts over */
+delete from main.sloth_blob_mark;
+
+delete from main.sloth_commit_mark;
+
 /* Only the commit operation reads .track files */
 insert into main.sloth_track
 select * from other.sloth_track;
@@ -52,6 +106,4 @@ select * from other.sloth_track;
 select fn from main.sloth_track;
 .output
 
-detach database other;
-
 .quit
@@ -16,35 +16,47 @@
 
 /* sloth commit SQL */
 
-SQL_OPTS
-SQL_DEBUG
-
 /* Set files to track */
 delete from sloth_track;
 
 .import .track sloth_track
 
-/* Import files */
+/* Stat the files */
 delete from sloth_stage;
 
-insert into sloth_stage (fn, d)
-select fn, readfile(fn) from sloth_track;
+insert into sloth_stage (fn, sig)
+select fn, stat_sig(fn) from sloth_track;
 
-/* Clean files: Remove problem characters */
-/* Carriage Return, \r, ^M */
+/* Files with unchanged stat data keep their hash from the index */
 update sloth_stage
-set d = replace(d, X'0D', '');
+set h = (select b.h from sloth_index as b
+    where b.fn = sloth_stage.fn and b.sig = sloth_stage.sig);
 
-/* Null character, \0, ^@ */
-update sloth_stage
-set d = replace(d, X'00', '');
+/*
+ * Import changed files only. sloth reads them in parallel, removes the
+ * problem characters (Carriage Return, \r, ^M and Null character, \0, ^@),
+ * and fills in the SHA-256 hash h. For blobs that are not stored yet, it
+ * also fills in the encoded data d, with enc, dict_id, base_h and depth:
+ * zstd compressed, or a delta against the last version of the file.
+ */
+.stage
 
-insert into sloth_blob (h, d)
+/* Deduplicate by hash, the data is never compared */
+insert into sloth_blob (h, d, enc, dict_id, base_h, depth)
 select
-sha1(a.d) as h,
-a.d
+a.h,
+a.d,
+a.enc,
+a.dict_id,
+a.base_h,
+a.depth
 from sloth_stage as a
-where a.d not in (select b.d from sloth_blob as b);
+where a.d is not null
+and a.h not in (select b.h from sloth_blob as b)
+group by a.h;
+
+/* Build the manifest of the new snapshot, its root goes in sloth_tmp_root */
+.tree
 
 /* Clamp the files */
 delete from sloth_stage_clamp;
@@ -52,10 +64,8 @@ delete from sloth_stage_clamp;
 insert into sloth_stage_clamp
 select
 a.fn,
-b.h
+a.h
 from sloth_stage as a
-inner join sloth_blob as b
-on a.d = b.d
 ;
 
 delete from sloth_non_zero_trap;
@@ -73,19 +83,37 @@ delete from sloth_prev_t;
 insert into sloth_prev_t (t)
 select max(t) from sloth_commit;
 
+delete from sloth_non_zero_trap;
+
+/* Will create an error if there have been no changes: the roots are equal */
+insert into sloth_non_zero_trap (x)
+select coalesce(
+    (select a.root_h from sloth_commit as a
+        where a.t = (select b.t from sloth_prev_t as b))
+    = (select c.h from sloth_tmp_root as c), 0);
+
 /* Fill in commit info */
-insert into sloth_commit (t, msg)
+insert into sloth_commit (t, msg, root_h)
 select
 (select b.i from sloth_tmp_int as b),
-(select trim(c.x) from sloth_tmp_text as c)
+(select trim(c.x) from sloth_tmp_text as c),
+(select d.h from sloth_tmp_root as d)
 ;
 
+/*
+ * Snapshots are found through the interval index sloth_file_time, and then
+ * checked exactly, as the index coordinates are rounded.
+ */
+
 /* Close off open records that are now gone (not staged) */
 update sloth_file
 set exit_t = (select b.i from sloth_tmp_int as b)
 where
+id in (select z.id from sloth_file_time as z
+    where z.entry_t <= (select y.i from sloth_tmp_int as y)
+      and z.exit_t > (select x.i from sloth_tmp_int as x))
 /* Record is open */
-(select c.i from sloth_tmp_int as c) >= entry_t
+and (select c.i from sloth_tmp_int as c) >= entry_t
 and (select d.i from sloth_tmp_int as d) < exit_t
 /* Record now gone */
 and (fn, h) not in
@@ -103,8 +131,11 @@ b.fn,
 b.h
 from sloth_file as b
 where
+b.id in (select z.id from sloth_file_time as z
+    where z.entry_t <= (select y.i from sloth_tmp_int as y)
+      and z.exit_t > (select x.i from sloth_tmp_int as x))
 /* Record is open */
-(select c.i from sloth_tmp_int as c) >= b.entry_t
+and (select c.i from sloth_tmp_int as c) >= b.entry_t
 and (select d.i from sloth_tmp_int as d) < b.exit_t
 );
 
@@ -119,33 +150,10 @@ strftime('%s', '9999-12-31 00:00:00')
 from sloth_stage_clamp as a
 ;
 
-delete from sloth_non_zero_trap;
+/* Refresh the index */
+delete from sloth_index;
 
-/* Will create an error if there have been no changes */
-insert into sloth_non_zero_trap (x)
-select z.count_now = z.count_prev and z.count_now = z.count_union
-from
-(select
-    (select count(w.h) from sloth_file as w
-        where (select a.i from sloth_tmp_int as a) >= w.entry_t
-          and (select b.i from sloth_tmp_int as b) <  w.exit_t
-    ) as count_now,
-
-    (select count(x.h) from sloth_file as x
-        where (select c.t from sloth_prev_t as c) >= x.entry_t
-          and (select d.t from sloth_prev_t as d) <  x.exit_t
-    ) as count_prev,
-
-    (select count(y.h) from
-        (select q.h, q.fn from sloth_file as q
-            where (select e.i from sloth_tmp_int as e) >= q.entry_t
-              and (select f.i from sloth_tmp_int as f) <  q.exit_t
-        union
-        select r.h, r.fn from sloth_file as r
-            where (select g.t from sloth_prev_t as g) >= r.entry_t
-              and (select h.t from sloth_prev_t as h) <  r.exit_t
-        ) as y
-    ) as count_union
-) as z;
+insert into sloth_index (fn, sig, h)
+select fn, sig, h from sloth_stage;
 
 .quit
@@ -16,47 +16,127 @@
 
 /* Data Definition Language (DDL) for sloth */
 
-SQL_OPTS
-SQL_DEBUG
-
 create table sloth_commit
 (t integer not null unique primary key,
 msg text not null,
+root_h text, /* Root sloth_tree of the snapshot */
 check(msg <> '')
 );
 
+/*
+ * Directory trees of the commit manifests (a Merkle tree), deduplicated by
+ * their hash, so unchanged directories are shared between commits.
+ */
+create table sloth_tree
+(h text not null unique primary key
+);
+
+create table sloth_tree_entry
+(tree_h text not null,
+name text not null,
+is_dir integer not null, /* 1: h is a subtree, 0: h is a blob */
+h text not null,
+primary key (tree_h, name, is_dir)
+);
+
+/*
+ * Blobs are deduplicated by their hash, the data itself is not indexed.
+ * Read the raw data with blob_data(h).
+ */
 create table sloth_blob
 (h text not null unique primary key,
-d blob not null unique
+d blob not null, /* Encoded data */
+enc integer not null default 0, /* 0: Raw, 1: zstd, 2: Delta, 3: Chunked */
+dict_id integer, /* zstd dictionary, NULL if none */
+base_h text, /* Base blob of a delta, NULL if none */
+depth integer not null default 0 /* Length of the delta chain */
 );
 
-create unique index uidx_blob_data on sloth_blob(d);
+/* Chunk lists of chunked blobs (large files). The chunks are blobs too. */
+create table sloth_chunk
+(h text not null,
+i integer not null, /* Position of the chunk in the file */
+chunk_h text not null,
+s integer not null, /* Size of the chunk */
+primary key (h, i)
+);
+
+/* zstd dictionaries trained on the small blobs (see sloth repack) */
+create table sloth_dict
+(id integer primary key autoincrement,
+d blob not null
+);
 
 create table sloth_file
-(fn text not null,
+(id integer primary key, /* Stable, as it links to sloth_file_time */
+fn text not null,
 h text not null,
 entry_t integer not null, /* Inclusive */
 exit_t integer not null, /* Exclusive */
 check(fn <> '')
 );
 
-/* Probably need some time index */
 create index idx_file_h on sloth_file(h);
 
+/*
+ * Interval index of sloth_file, one [entry_t, exit_t] box per record, kept
+ * in step by the triggers below. It finds the records that are open at a
+ * time without scanning the whole history. R*Tree coordinates are 32-bit
+ * floats, rounded outwards, so queries recheck the exact times.
+ */
+create virtual table sloth_file_time using rtree(id, entry_t, exit_t);
+
+create trigger trg_file_time_insert after insert on sloth_file
+begin
+insert into sloth_file_time (id, entry_t, exit_t)
+values (new.id, new.entry_t, new.exit_t);
+end;
+
+create trigger trg_file_time_update after update of entry_t, exit_t
+on sloth_file
+begin
+update sloth_file_time
+set entry_t = new.entry_t, exit_t = new.exit_t
+where id = new.id;
+end;
+
+create trigger trg_file_time_delete after delete on sloth_file
+begin
+delete from sloth_file_time where id = old.id;
+end;
+
+/* Finds the last version of a file, the base of a delta */
+create index idx_file_fn_entry_t on sloth_file(fn, entry_t);
+
 create table sloth_track
 (fn text not null unique primary key,
 check(fn <> '')
 );
 
+/* Files being committed. d is only read when the stat data has changed */
 create table sloth_stage
 (fn text not null unique primary key,
-d blob not null unique,
+sig text,
+h text,
+d blob, /* Encoded data, only for blobs that are not stored yet */
+enc integer,
+dict_id integer,
+base_h text,
+depth integer,
 check(fn <> '')
 );
 
 create table sloth_stage_clamp
 (fn text not null unique primary key,
-h text not null unique,
+h text not null,
+check(fn <> '')
+);
+
+/* Stat signature and hash of the files at the last commit (see stat_sig) */
+create table sloth_index
+(fn text not null unique primary key,
+sig text,
+h text not null,
 check(fn <> '')
 );
 
@@ -73,7 +153,7 @@ check(full_name <> ''),
 check(email <> '')
 );
 
-/* Just used for export */
+/* Export marks, kept between exports, see migrate_9.sql */
 create table sloth_blob_mark
 (h text not null unique primary key,
 mk integer not null unique
@@ -81,7 +161,7 @@ mk integer not null unique
 
 create unique index uidx_blob_mark_mk on sloth_blob_mark(mk);
 
-/* Just used for export */
+/* Exported commits, with their marks */
 create table sloth_commit_mark
 (t integer not null unique primary key,
 mk integer not null unique
@@ -98,10 +178,17 @@ create table sloth_tmp_text
 check(x <> '')
 );
 
+create table sloth_tmp_root
+(h text not null unique primary key
+);
+
 /* Only one zero is accepted */
 create table sloth_non_zero_trap
 (x integer not null unique,
 check (x = 0)
 );
 
+/* Schema version, must match SCHEMA_VERSION in sloth.c */
+pragma user_version = 9;
+
 .quit
@@ -16,19 +16,68 @@
 
 /* sloth diff SQL */
 
-SQL_OPTS
+/* The working tree is made of the tracked files, as for a commit */
+delete from sloth_track;
+
+.import .track sloth_track
+
+/* Stat the files */
+delete from sloth_stage;
+
+insert into sloth_stage (fn, sig)
+select fn, stat_sig(fn) from sloth_track;
+
+/* Files with unchanged stat data keep their hash from the index */
+update sloth_stage
+set h = (select b.h from sloth_index as b
+    where b.fn = sloth_stage.fn and b.sig = sloth_stage.sig);
+
+/* Hash the changed files only, nothing is stored */
+.hash
+
+/* Tracked files that do not exist are not in the working tree */
+delete from sloth_stage where h is null;
 
 delete from sloth_tmp_int;
 insert into sloth_tmp_int (i)
 select max(t) from sloth_commit;
 
-/* Write open record files to the temporary directory */
+/* The files that differ, with a NULL hash on the side that lacks them */
+create temp table sloth_diff (fn text primary key, h1 text, h2 text);
+
+/* Open records of the last commit that are modified or gone */
+insert into sloth_diff (fn, h1, h2)
 select
-writefile((select * from sloth_tmp_text) || 'DIR_SEP' || a.fn, b.d)
+a.fn,
+a.h,
+b.h
 from sloth_file as a
-inner join sloth_blob as b
-on a.h = b.h
-where (select h.i from sloth_tmp_int as h) >= a.entry_t
-    and (select k.i from sloth_tmp_int as k) < a.exit_t;
+left join sloth_stage as b on b.fn = a.fn
+/* Interval index first, then the exact check */
+where a.id in (select z.id from sloth_file_time as z
+        where z.entry_t <= (select y.i from sloth_tmp_int as y)
+          and z.exit_t > (select x.i from sloth_tmp_int as x))
+    and (select h.i from sloth_tmp_int as h) >= a.entry_t
+    and (select k.i from sloth_tmp_int as k) < a.exit_t
+    and (b.h is null or b.h <> a.h);
+
+/* New files */
+insert into sloth_diff (fn, h1, h2)
+select
+a.fn,
+null,
+a.h
+from sloth_stage as a
+where a.fn not in
+(select b.fn
+from sloth_file as b
+where b.id in (select z.id from sloth_file_time as z
+        where z.entry_t <= (select y.i from sloth_tmp_int as y)
+          and z.exit_t > (select x.i from sloth_tmp_int as x))
+    and (select h.i from sloth_tmp_int as h) >= b.entry_t
+    and (select k.i from sloth_tmp_int as k) < b.exit_t);
+
+/* Only these files are read, and diffed in-process */
+.diff
 
 .quit
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* sloth git import SQL, run for each commit (see import_git) */
+
+/*
+ * sloth_stage only holds the files that the commit changed: the files that
+ * were added or modified, with their hash and the encoded data of the new
+ * blobs, and the deleted files, without a hash. The root of the new
+ * manifest is in sloth_tmp_root.
+ */
+
+/* Deduplicate by hash, the data is never compared */
+insert into sloth_blob (h, d, enc, dict_id, base_h, depth)
+select
+a.h,
+a.d,
+a.enc,
+a.dict_id,
+a.base_h,
+a.depth
+from sloth_stage as a
+where a.d is not null
+and a.h not in (select b.h from sloth_blob as b)
+group by a.h;
+
+delete from sloth_non_zero_trap;
+
+/* Will create an error if there is an old time greater than the current time */
+insert into sloth_non_zero_trap
+select
+count(a.t)
+from sloth_commit as a
+where a.t > (select b.i from sloth_tmp_int as b);
+
+/* Fill in commit info */
+insert into sloth_commit (t, msg, root_h)
+select
+(select b.i from sloth_tmp_int as b),
+(select trim(c.x) from sloth_tmp_text as c),
+(select d.h from sloth_tmp_root as d)
+;
+
+/*
+ * Close off the open records of the changed files only, found by the index
+ * on the records of a path, so the cost follows the size of the change.
+ */
+update sloth_file
+set exit_t = (select b.i from sloth_tmp_int as b)
+where fn in (select c.fn from sloth_stage as c)
+/* Record is open */
+and (select d.i from sloth_tmp_int as d) >= entry_t
+and (select e.i from sloth_tmp_int as e) < exit_t;
+
+/* Insert new records */
+insert into sloth_file (fn, h, entry_t, exit_t)
+select
+a.fn,
+a.h,
+(select b.i from sloth_tmp_int as b),
+/* Will not overflow if timezone is added */
+strftime('%s', '9999-12-31 00:00:00')
+from sloth_stage as a
+where a.h is not null
+;
+
+.quit
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* sloth git import SQL, after the last commit */
+
+/* The snapshot of the last commit, whose time is in sloth_tmp_int */
+create temp table sloth_target (fn text primary key, h text);
+
+insert into sloth_target (fn, h)
+select
+a.fn,
+a.h
+from sloth_file as a
+/* Interval index first, then the exact check */
+where a.id in (select z.id from sloth_file_time as z
+        where z.entry_t <= (select y.i from sloth_tmp_int as y)
+          and z.exit_t > (select x.i from sloth_tmp_int as x))
+    and (select h.i from sloth_tmp_int as h) >= a.entry_t
+    and (select k.i from sloth_tmp_int as k) < a.exit_t;
+
+/* Track the files of the snapshot */
+.output .track
+select fn from sloth_target order by fn;
+.output
+
+/*
+ * The index holds the last commit. The working tree was not written by
+ * sloth, so there are no stat signatures, and the files are hashed again at
+ * the next commit.
+ */
+delete from sloth_index;
+
+insert into sloth_index (fn, sig, h)
+select fn, null, h from sloth_target;
+
+.quit
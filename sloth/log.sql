@@ -16,8 +16,6 @@
 
 /* sloth log SQL */
 
-SQL_OPTS
-
 select
 datetime(t, 'unixepoch', 'localtime'),
 msg
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* sloth log of a path SQL */
+
+/*
+ * The changes to a file, or to the files under a directory, newest first.
+ * Only the records of the path are read, through idx_file_fn_entry_t: the
+ * path itself, and the range of the names under path/ ('0' follows '/').
+ */
+with
+p (x) as (select rtrim(a.x, '/') from sloth_tmp_text as a),
+r (fn, entry_t, exit_t) as (
+    select b.fn, b.entry_t, b.exit_t
+    from sloth_file as b, p
+    where b.fn = p.x
+        or (b.fn > p.x || '/' and b.fn < p.x || '0')
+),
+e (t, op, fn) as (
+    /* A record starts: modified if the last one of the file ends there */
+    select
+    a.entry_t,
+    case when exists (select 1 from r as b
+        where b.fn = a.fn and b.exit_t = a.entry_t) then 'M' else 'A' end,
+    a.fn
+    from r as a
+    union all
+    /* A record ends without a new one: deleted */
+    select
+    a.exit_t,
+    'D',
+    a.fn
+    from r as a
+    where a.exit_t < strftime('%s', '9999-12-31 00:00:00')
+    and not exists (select 1 from r as b
+        where b.fn = a.fn and b.entry_t = a.exit_t)
+)
+select
+datetime(e.t, 'unixepoch', 'localtime'),
+e.op,
+e.fn,
+c.msg
+from e
+inner join sloth_commit as c on c.t = e.t
+order by
+e.t desc,
+e.fn;
+
+.quit
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* sloth migration to schema version 1: Add the stat-cache index */
+
+/* The staging tables only hold data during a commit */
+drop table sloth_stage;
+
+drop table sloth_stage_clamp;
+
+create table sloth_stage
+(fn text not null unique primary key,
+sig text,
+h text,
+d blob,
+check(fn <> '')
+);
+
+create table sloth_stage_clamp
+(fn text not null unique primary key,
+h text not null,
+check(fn <> '')
+);
+
+create table sloth_index
+(fn text not null unique primary key,
+sig text,
+h text not null,
+check(fn <> '')
+);
+
+.quit
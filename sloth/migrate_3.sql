@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * sloth migration to schema version 3: Rehash all blobs with SHA-256,
+ * replacing the SHA-1 hashes everywhere that they are referenced.
+ */
+
+create temp table sloth_rehash
+(old text not null unique primary key,
+new text not null unique
+);
+
+insert into sloth_rehash (old, new)
+select h, sha256(d) from sloth_blob;
+
+/* SHA-1 and SHA-256 hashes differ in length, so there are no conflicts */
+update sloth_blob
+set h = (select a.new from sloth_rehash as a where a.old = sloth_blob.h);
+
+update sloth_file
+set h = (select a.new from sloth_rehash as a where a.old = sloth_file.h);
+
+update sloth_index
+set h = (select a.new from sloth_rehash as a where a.old = sloth_index.h);
+
+/* Only used for export, which regenerates them */
+delete from sloth_blob_mark;
+
+drop table sloth_rehash;
+
+.quit
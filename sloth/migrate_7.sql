@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * sloth migration to schema version 7: An interval index on the record
+ * times of sloth_file. The records get an explicit id first, as vacuum may
+ * renumber implicit rowids.
+ */
+
+create table sloth_file_new
+(id integer primary key,
+fn text not null,
+h text not null,
+entry_t integer not null,
+exit_t integer not null,
+check(fn <> '')
+);
+
+insert into sloth_file_new (fn, h, entry_t, exit_t)
+select fn, h, entry_t, exit_t from sloth_file;
+
+drop table sloth_file;
+
+alter table sloth_file_new rename to sloth_file;
+
+create index idx_file_h on sloth_file(h);
+
+create index idx_file_fn_entry_t on sloth_file(fn, entry_t);
+
+create virtual table sloth_file_time using rtree(id, entry_t, exit_t);
+
+create trigger trg_file_time_insert after insert on sloth_file
+begin
+insert into sloth_file_time (id, entry_t, exit_t)
+values (new.id, new.entry_t, new.exit_t);
+end;
+
+create trigger trg_file_time_update after update of entry_t, exit_t
+on sloth_file
+begin
+update sloth_file_time
+set entry_t = new.entry_t, exit_t = new.exit_t
+where id = new.id;
+end;
+
+create trigger trg_file_time_delete after delete on sloth_file
+begin
+delete from sloth_file_time where id = old.id;
+end;
+
+insert into sloth_file_time (id, entry_t, exit_t)
+select id, entry_t, exit_t from sloth_file;
+
+.quit
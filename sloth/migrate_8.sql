@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * sloth migration to schema version 8: A manifest tree per commit, built
+ * for the existing commits from their snapshots.
+ */
+
+alter table sloth_commit add column root_h text;
+
+create table sloth_tree
+(h text not null unique primary key
+);
+
+create table sloth_tree_entry
+(tree_h text not null,
+name text not null,
+is_dir integer not null, /* 1: h is a subtree, 0: h is a blob */
+h text not null,
+primary key (tree_h, name, is_dir)
+);
+
+create table sloth_tmp_root
+(h text not null unique primary key
+);
+
+.roots
+
+.quit
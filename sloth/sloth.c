@@ -22,109 +22,334 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <fcntl.h>
 
 #ifdef _WIN32
-/* For rand_s */
-#define _CRT_RAND_S
 #include <windows.h>
+#include <io.h>
+#include <direct.h>
+#define open _open
+#define close _close
+#define rmdir _rmdir
+#define popen _popen
+#define pclose _pclose
+#define POPEN_READ "rb"
 #else
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <pthread.h>
 #include <unistd.h>
+#define POPEN_READ "r"
 #endif
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <sqlite3.h>
+#include <zdict.h>
+#include <zstd.h>
 
 /*
  * Set to the the directory where sloth is installed.
- * The SQL scripts and m4 script must also be in this
- * same directory.
+ * The SQL scripts must also be in this same directory.
  */
 #define SCRIPT_DIR "/home/logan/bin"
-#define TMP_IN_DIR "/tmp"
+
+/* Length of a SHA-256 hash as a hex string */
+#define HASH_HEX_LEN 64
+/* Maximum number of threads used to read and hash files */
+#define MAX_THREADS 16
+
+/* Blob encodings (sloth_blob.enc) */
+#define ENC_RAW 0
+#define ENC_ZSTD 1
+#define ENC_DELTA 2             /* zstd compressed delta against base_h */
+#define ENC_CHUNKED 3           /* Empty, the chunks are in sloth_chunk */
+
+/* zstd compression levels for commits, and for the repack command */
+#define COMMIT_LEVEL 3
+#define REPACK_LEVEL 19
+/* Files up to this size are compressed with the repository dictionary */
+#define DICT_FILE_MAX 131072
+/* Maximum dictionary size, and maximum total size of the training samples */
+#define DICT_CAP 112640
+#define DICT_SAMPLE_MAX (DICT_CAP * 100)
+
+/* Files of at least this size are streamed and cut into chunks */
+#define CHUNK_FILE_MIN 16777216
+/* Total size of the smaller files that are staged in memory at a time */
+#define STAGE_BATCH_MAX 268435456
+/* Chunk sizes, and the masks of the gear hash for before and after CDC_AVG */
+#define CDC_MIN 16384
+#define CDC_AVG 65536
+#define CDC_MAX 262144
+#define CDC_MASK_S 0xffffc000u
+#define CDC_MASK_L 0xfffc0000u
+
+/* Files in this size range are stored as deltas against their last version */
+#define DELTA_FILE_MIN 4096
+#define DELTA_FILE_MAX CHUNK_FILE_MIN
+/* Maximum length of a delta chain, after which a full blob is stored */
+#define DELTA_MAX_DEPTH 16
+/* Size of the base blocks that are indexed to find matches */
+#define DELTA_BLOCK 16
+#define DELTA_PRIME 257
+/* Hash table slot of a block hash, n is a power of two */
+#define DELTA_SLOT(h, n) ((((h) ^ (h) >> 15) * 2654435761u) & ((n) - 1))
+/* Maximum number of bytes of a varint holding a 64-bit number */
+#define VARINT_MAX 10
+/* Size limit of the cache of reconstructed delta blobs */
+#define CACHE_MAX 67108864
+
+/* Lines of context around the changes in a diff */
+#define DIFF_CONTEXT 3
+/* Edit cost after which a diff settles for a script that is not minimal */
+#define DIFF_COST_MAX 4096
+
+/* Version of the database schema, see ddl.sql and the migrate_N.sql scripts */
+#define SCHEMA_VERSION 9
+
+/* Only one sloth can use a repository while it holds a lock on this file */
+#define LOCK_FILE "sloth.lock"
+
+/* Column and row separators, and the text of NULL, in query output */
+#define COL_SEP '^'
+#define ROW_SEP '\n'
+#define NULL_STR "NULL"
 
 #define STR_BLOCK 512
 
 #define AOF(a, b) ((a) > SIZE_MAX - (b))
 #define MOF(a, b) ((a) && (b) > SIZE_MAX / (a))
 
-char *random_alnum_str(size_t len)
-{
-    /*
-     * Returns a random alphanumeric string of length len.
-     * Must free after use. Returns NULL upon failure.
-     */
-    char *p;
-    unsigned char *t, u;
-    size_t i, j;
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
 #ifdef _WIN32
-    unsigned int r;
-    size_t ts = sizeof(unsigned int);
+#define LOCK_MUTEX(m) EnterCriticalSection(m)
+#define UNLOCK_MUTEX(m) LeaveCriticalSection(m)
 #else
-    FILE *fp;
-    size_t ts = 64;
+#define LOCK_MUTEX(m) pthread_mutex_lock(m)
+#define UNLOCK_MUTEX(m) pthread_mutex_unlock(m)
 #endif
 
-    if (AOF(len, 1))
-        return NULL;
-    if ((p = malloc(len + 1)) == NULL)
-        return NULL;
-
-#ifndef _WIN32
-    if ((t = malloc(ts)) == NULL) {
-        free(p);
-        return NULL;
-    }
-    if ((fp = fopen("/dev/urandom", "r")) == NULL) {
-        free(p);
-        free(t);
-        return NULL;
-    }
+/* Start routine of a worker thread */
+#ifdef _WIN32
+typedef DWORD(WINAPI * thread_fn) (LPVOID);
+#else
+typedef void *(*thread_fn) (void *);
 #endif
 
-    j = 0;
-    while (j != len) {
+/* SHA-256 round constants */
+uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Gear table of the chunking rolling hash, see init_gear */
+uint32_t gear[256];
+
+/* SHA-256 hash in progress */
+struct sha256_ctx {
+    uint32_t h[8];              /* State */
+    unsigned char b[64];        /* Partial block */
+    size_t n;                   /* Number of bytes in b */
+    uint64_t len;               /* Total number of bytes */
+};
+
+/* A chunk of a large file */
+struct chunk {
+    char h[HASH_HEX_LEN + 1];
+    size_t s;
+};
+
+/* A file of a snapshot, from which a manifest is built */
+struct tree_item {
+    char *fn;
+    char h[HASH_HEX_LEN + 1];
+};
+
+/* An entry of a manifest tree: A file, or a subtree */
+struct tree_entry {
+    char *name;                 /* Not terminated when building, see len */
+    size_t len;
+    int is_dir;
+    char h[HASH_HEX_LEN + 1];   /* Blob hash, or tree hash of a subtree */
+};
+
+/* Statements used while building trees */
+struct tree_ctx {
+    sqlite3_stmt *sel;
+    sqlite3_stmt *ins_tree;
+    sqlite3_stmt *ins_entry;
+};
+
+/*
+ * Called by tree_diff for each changed file. op is 'A', 'D' or 'M', and h1
+ * or h2 is NULL for an added or deleted file. Returns 1 to stop.
+ */
+typedef int (*change_fn) (void *arg, int op, char *path, char *h1,
+                          char *h2);
+
+/* A file to be read, cleaned, hashed and compressed by a staging thread */
+struct stage_job {
+    char *fn;                   /* Filename */
+    char *d;                    /* Cleaned file data, then the encoded data */
+    size_t s;                   /* Size of d */
+    char h[HASH_HEX_LEN + 1];   /* Hash of the cleaned data */
+    char *base;                 /* Last version of the file, for a delta */
+    size_t base_s;
+    char base_h[HASH_HEX_LEN + 1];      /* Hash of base, empty if none */
+    int depth;                  /* Delta chain length if stored as a delta */
+    int chunked;                /* Large file, left to stage_chunked */
+    int is_new;                 /* The hash is not in sloth_blob yet */
+    int enc;                    /* Encoding of d */
+    int use_dict;               /* d was compressed with the dictionary */
+    int err;                    /* 1: Cannot read, 2: Cannot compress */
+    int missing;                /* The file does not exist (only hashing) */
+};
+
+/* Jobs shared by the staging threads, which take the next job in turn */
+struct stage_pool {
+    struct stage_job *job;
+    size_t n;                   /* Number of jobs */
+    size_t next;                /* Index of the next job to take */
+    int phase;                  /* 1: Read, clean and hash, 2: Compress */
+    int hash_only;              /* Only hash, do not keep the data */
+    ZSTD_CDict *cdict;          /* Repository dictionary (NULL if none) */
 #ifdef _WIN32
-        if (rand_s(&r)) {
-            free(p);
-            return NULL;
-        }
-        t = (unsigned char *) &r;
+    CRITICAL_SECTION mutex;
 #else
-        if (fread(t, 1, ts, fp) != ts) {
-            free(p);
-            free(t);
-            fclose(fp);
-            return NULL;
-        }
+    pthread_mutex_t mutex;
 #endif
+};
 
-        for (i = 0; i < ts; ++i) {
-            u = *(t + i);
-            if (isalnum(u)) {
-                *(p + j++) = u;
-                if (j == len)
-                    break;
-            }
-        }
-    }
+/* A blob of a git fast-export stream, by mark */
+struct import_blob {
+    char h[HASH_HEX_LEN + 1];   /* Empty if the mark is not a blob */
+    char *d;                    /* Cleaned data, until a commit stores it */
+    size_t s;
+};
 
-    *(p + j) = '\0';
+/* State of a git import */
+struct import_ctx {
+    sqlite3 *db;
+    sqlite3_stmt *sel;          /* Is a blob stored */
+    sqlite3_stmt *stage;        /* Adds a change to sloth_stage */
+    struct tree_ctx tc;
+    ZSTD_CCtx *cctx;            /* For large blobs */
+    struct import_blob *blob;   /* Indexed by mark */
+    size_t num_blob;
+    struct tree_item *item;     /* Changes of the commit, "" deletes */
+    size_t n;
+    size_t cap;
+    struct stage_pool sp;       /* New blobs of the commit */
+    size_t job_cap;
+    char root[HASH_HEX_LEN + 1];        /* Manifest of the last commit */
+};
 
-#ifndef _WIN32
-    free(t);
-    if (fclose(fp)) {
-        free(p);
-        return NULL;
-    }
+/* A loaded zstd dictionary. Link together to form a singly linked list. */
+struct ddict {
+    sqlite3_int64 id;           /* sloth_dict id */
+    ZSTD_DDict *dd;
+    struct ddict *next;
+};
+
+/* A reconstructed delta blob. Link together to form a singly linked list. */
+struct blob_cache {
+    char h[HASH_HEX_LEN + 1];
+    char *d;
+    size_t s;
+    struct blob_cache *next;
+};
+
+/* A file to write (or delete, if h is empty) during a checkout */
+struct checkout_job {
+    char *fn;
+    char h[HASH_HEX_LEN + 1];
+    int tracked;                /* The file is in the working tree */
+    int dirty;                  /* The file has changes since the last commit */
+    int err;                    /* Cleared once written or deleted */
+};
+
+/* Jobs shared by the checkout threads, which take the next job in turn */
+struct checkout_pool {
+    struct checkout_job *job;
+    size_t n;                   /* Number of jobs */
+    size_t next;                /* Index of the next job to take */
+#ifdef _WIN32
+    CRITICAL_SECTION mutex;
+#else
+    pthread_mutex_t mutex;
 #endif
+};
 
-    return p;
-}
+/* A line of a text being diffed, which points into the text */
+struct diff_line {
+    char *p;
+    size_t len;                 /* Including the newline, if any */
+    uint32_t hash;
+    long id;                    /* Equal lines have the same id */
+};
+
+/*
+ * State of a diff between texts a and b. Only the lines that occur in both
+ * texts take part in the search, as the others are always changes.
+ */
+struct diff_ctx {
+    long *a;                    /* Ids of the lines of a that are in b */
+    long *b;                    /* Ids of the lines of b that are in a */
+    long *ra;                   /* Line numbers in a of the lines of a */
+    long *rb;                   /* Line numbers in b of the lines of b */
+    long *fd;                   /* Forward search, indexed by diagonal */
+    long *bd;                   /* Backward search, indexed by diagonal */
+    char *del;                  /* Lines of a to delete */
+    char *ins;                  /* Lines of b to insert */
+};
+
+/* A change of a commit being exported */
+struct export_item {
+    int op;                     /* 'M' or 'D' */
+    char *path;
+    sqlite3_int64 mk;           /* Blob mark, for 'M' */
+};
+
+/* State of an export, shared with the change callback */
+struct export_ctx {
+    sqlite3 *db;
+    FILE *out;
+    sqlite3_stmt *get_mark;
+    sqlite3_stmt *put_mark;
+    sqlite3_stmt *size;         /* Size of a chunked blob, else 0 */
+    sqlite3_stmt *data;         /* Data of a blob that is not chunked */
+    sqlite3_stmt *chunks;       /* Data of the chunks of a blob, in order */
+    sqlite3_int64 next_mk;
+    struct export_item *item;   /* Changes of the current commit */
+    size_t n;
+    size_t cap;
+};
+
+/* Decompression state of a database connection (used by blob_data) */
+struct codec {
+    ZSTD_DCtx *dctx;
+    struct ddict *dicts;        /* Dictionaries loaded so far */
+    struct blob_cache *cache;   /* Most recently used first */
+    size_t cache_s;             /* Total size of the cached data */
+};
 
 char *concat(char *str1, ...)
 {
@@ -197,39 +422,6 @@ char *concat(char *str1, ...)
     return p;
 }
 
-char *make_tmp_dir(char *in_dir)
-{
-    /*
-     * Creates a temporary directory under in_dir.
-     * Need to free after use. Returns NULL on failure.
-     */
-    char *name;
-    char *path;
-    size_t try = 10;            /* Try 10 times */
-    char *dir_sep_str;
-#ifdef _WIN32
-    dir_sep_str = "\\";
-#else
-    dir_sep_str = "/";
-#endif
-
-    while (try--) {
-        if ((name = random_alnum_str(36)) == NULL)
-            return NULL;
-        if ((path = concat(in_dir, dir_sep_str, name, NULL)) == NULL) {
-            free(name);
-            return NULL;
-        }
-        free(name);
-        if (mkdir(path, 0777)) {
-            free(path);
-        } else {
-            return path;
-        }
-    }
-    return NULL;
-}
-
 int filesize(char *fn, size_t * fs)
 {
     /* Gets the filesize of a filename */
@@ -244,80 +436,181 @@ int filesize(char *fn, size_t * fs)
     return 0;
 }
 
-int cp_file(char *from_file, char *to_file)
+void sha256_block(uint32_t * h, unsigned char *b)
 {
-    int ret = 0;
-    FILE *fp_from = NULL;
-    FILE *fp_to = NULL;
-    size_t fs, whole_blocks, part_block_size;
-    char *p;
+    /* Processes one 64 byte block of SHA-256 input */
+    uint32_t w[64];
+    uint32_t a, b2, c, d, e, f, g, hh, s0, s1, t1, t2;
+    int i;
 
-    if (filesize(from_file, &fs))
-        return 1;
+    for (i = 0; i < 16; ++i)
+        *(w + i) = (uint32_t) * (b + 4 * i) << 24
+            | (uint32_t) * (b + 4 * i + 1) << 16
+            | (uint32_t) * (b + 4 * i + 2) << 8 | (uint32_t) * (b + 4 * i + 3);
 
-    if ((p = malloc(fs > BUFSIZ ? BUFSIZ : fs)) == NULL)
-        return 1;
+    for (i = 16; i < 64; ++i) {
+        s0 = ROTR(*(w + i - 15), 7) ^ ROTR(*(w + i - 15), 18)
+            ^ (*(w + i - 15) >> 3);
+        s1 = ROTR(*(w + i - 2), 17) ^ ROTR(*(w + i - 2), 19)
+            ^ (*(w + i - 2) >> 10);
+        *(w + i) = *(w + i - 16) + s0 + *(w + i - 7) + s1;
+    }
 
-    if ((fp_from = fopen(from_file, "rb")) == NULL) {
-        ret = 1;
-        goto clean_up;
+    a = *h;
+    b2 = *(h + 1);
+    c = *(h + 2);
+    d = *(h + 3);
+    e = *(h + 4);
+    f = *(h + 5);
+    g = *(h + 6);
+    hh = *(h + 7);
+
+    for (i = 0; i < 64; ++i) {
+        s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        t1 = hh + s1 + ((e & f) ^ (~e & g)) + *(sha256_k + i) + *(w + i);
+        s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        t2 = s0 + ((a & b2) ^ (a & c) ^ (b2 & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b2;
+        b2 = a;
+        a = t1 + t2;
     }
 
-    if ((fp_to = fopen(to_file, "wb")) == NULL) {
-        ret = 1;
-        goto clean_up;
+    *h += a;
+    *(h + 1) += b2;
+    *(h + 2) += c;
+    *(h + 3) += d;
+    *(h + 4) += e;
+    *(h + 5) += f;
+    *(h + 6) += g;
+    *(h + 7) += hh;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+    /* Starts a SHA-256 hash that is fed in pieces */
+    uint32_t h0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->h, h0, sizeof(h0));
+    ctx->n = 0;
+    ctx->len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, unsigned char *p, size_t s)
+{
+    /* Adds s bytes at p to a SHA-256 hash */
+    size_t k;
+
+    ctx->len += s;
+
+    if (ctx->n) {
+        k = 64 - ctx->n < s ? 64 - ctx->n : s;
+        memcpy(ctx->b + ctx->n, p, k);
+        ctx->n += k;
+        p += k;
+        s -= k;
+        if (ctx->n < 64)
+            return;
+        sha256_block(ctx->h, ctx->b);
+        ctx->n = 0;
     }
 
-    whole_blocks = fs / BUFSIZ;
+    for (; s >= 64; p += 64, s -= 64)
+        sha256_block(ctx->h, p);
 
-    while (whole_blocks) {
-        if (fread(p, 1, BUFSIZ, fp_from) != BUFSIZ) {
-            ret = 1;
-            goto clean_up;
-        }
-        if (fwrite(p, 1, BUFSIZ, fp_to) != BUFSIZ) {
-            ret = 1;
-            goto clean_up;
-        }
-        --whole_blocks;
+    if (s) {
+        memcpy(ctx->b, p, s);
+        ctx->n = s;
     }
+}
 
-    part_block_size = fs % BUFSIZ;
+void sha256_final(struct sha256_ctx *ctx, char *hex)
+{
+    /*
+     * Finishes a SHA-256 hash, and writes it to hex as a lowercase hex
+     * string. hex must have room for HASH_HEX_LEN + 1 chars.
+     */
+    unsigned char last[128];
+    uint32_t hi, lo;
+    size_t i, r = ctx->n, n;
 
-    if (part_block_size) {
-        if (fread(p, 1, part_block_size, fp_from) != part_block_size) {
-            ret = 1;
-            goto clean_up;
-        }
-        if (fwrite(p, 1, part_block_size, fp_to) != part_block_size) {
-            ret = 1;
-            goto clean_up;
-        }
+    /* Pad the remainder, then append the length in bits (big endian) */
+    if (r)
+        memcpy(last, ctx->b, r);
+    *(last + r) = 0x80;
+    n = r + 1 + 8 <= 64 ? 64 : 128;
+    memset(last + r + 1, 0, n - r - 1);
+    hi = (uint32_t) (ctx->len >> 29);
+    lo = (uint32_t) (ctx->len << 3);
+    for (i = 0; i < 4; ++i) {
+        *(last + n - 8 + i) = hi >> (24 - 8 * i) & 0xff;
+        *(last + n - 4 + i) = lo >> (24 - 8 * i) & 0xff;
     }
+    sha256_block(ctx->h, last);
+    if (n == 128)
+        sha256_block(ctx->h, last + 64);
 
-  clean_up:
-    free(p);
-    if (fclose(fp_from))
-        ret = 1;
-    if (fclose(fp_to))
-        ret = 1;
+    for (i = 0; i < 8; ++i)
+        sprintf(hex + 8 * i, "%08lx", (unsigned long) *(ctx->h + i));
+}
 
-    return ret;
+void sha256_hex(unsigned char *p, size_t s, char *hex)
+{
+    /*
+     * Computes the SHA-256 hash of s bytes at p, and writes it to hex as a
+     * lowercase hex string. hex must have room for HASH_HEX_LEN + 1 chars.
+     */
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, p, s);
+    sha256_final(&ctx, hex);
 }
 
-int mv_file(char *from_file, char *to_file)
+int lock_repo(int *fd)
 {
+    /*
+     * Takes an exclusive lock on the lock file, so that concurrent sloth
+     * invocations cannot clobber each other. The lock is held through the
+     * open file descriptor, stored in fd, and is released by the operating
+     * system when the process ends, however it ends. So the lock file is
+     * never stale, and is left in place.
+     */
 #ifdef _WIN32
-    /* NOT atomic */
-    if (!MoveFileEx
-        (from_file, to_file,
-         MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
-        return 1;
+    OVERLAPPED ov;
 #else
-    /* Atomic */
-    if (rename(from_file, to_file))
+    struct flock fl;
+#endif
+    int busy;
+
+    if ((*fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666)) == -1) {
+        fprintf(stderr, "%s: Cannot open lock file\n", LOCK_FILE);
         return 1;
+    }
+
+#ifdef _WIN32
+    memset(&ov, 0, sizeof(OVERLAPPED));
+    busy = !LockFileEx((HANDLE) _get_osfhandle(*fd),
+                       LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY,
+                       0, 1, 0, &ov);
+#else
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+    busy = fcntl(*fd, F_SETLK, &fl) == -1;
 #endif
+    if (busy) {
+        fprintf(stderr, "%s is locked: Another sloth is running\n",
+                LOCK_FILE);
+        close(*fd);
+        *fd = -1;
+        return 1;
+    }
     return 0;
 }
 
@@ -406,11 +699,11 @@ char *directory_name(char *file_path)
     return p;
 }
 
-int sys_cmd(char *cmd)
+int close_cmd(FILE * fp)
 {
-    /* Executes a system command */
+    /* Closes a pipe opened by popen, and checks the exit status */
     int r;
-    if ((r = system(cmd)) == -1)
+    if ((r = pclose(fp)) == -1)
         return 1;
 #ifdef _WIN32
     if (!r)
@@ -422,210 +715,4605 @@ int sys_cmd(char *cmd)
     return 1;
 }
 
-int run_sql(char *db_name, char *script_dir, char *script_name)
+char *read_file(char *fn, size_t * fs)
 {
-    int ret = 0;
-    char *sql_path;
-    char *macro_path;
-    char *cmd;
-
-    if ((sql_path = path_join(script_dir, script_name)) == NULL)
-        return 1;
-    if ((macro_path = path_join(script_dir, "macros.m4")) == NULL)
-        return 1;
-    if ((cmd =
-         concat("m4 ", macro_path, " ", sql_path, " | sqlite3 ", db_name,
-                NULL)) == NULL) {
-        ret = 1;
-        goto clean_up;
-    }
+    /*
+     * Reads a whole file into memory and stores the filesize in fs.
+     * A terminating '\0' char is appended (it is not counted in fs).
+     * Must free after use. Returns NULL upon failure.
+     */
+    FILE *fp;
+    char *p;
 
-    if (sys_cmd(cmd)) {
-        ret = 1;
-        goto clean_up;
-    }
+    if (filesize(fn, fs))
+        return NULL;
 
-  clean_up:
-    free(sql_path);
-    free(macro_path);
-    free(cmd);
-    return ret;
-}
+    if (AOF(*fs, 1))
+        return NULL;
 
-int sloth_commit(char *script_dir, char *msg, char *time, int backup)
-{
-    char *cmd;
+    if ((p = malloc(*fs + 1)) == NULL)
+        return NULL;
 
-    if (backup) {
-        if (cp_file("sloth.db", "sloth_copy.db"))
-            return 1;
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        free(p);
+        return NULL;
     }
 
-    if ((cmd =
-         concat("sqlite3 sloth_copy.db \"delete from sloth_tmp_text; ",
-                "insert into sloth_tmp_text (x) values (\'", msg,
-                "\');\"", NULL)) == NULL)
-        return 1;
-
-    if (sys_cmd(cmd)) {
-        free(cmd);
-        return 1;
+    if (fread(p, 1, *fs, fp) != *fs) {
+        free(p);
+        fclose(fp);
+        return NULL;
     }
-    free(cmd);
 
-    if (sys_cmd("sqlite3 sloth_copy.db \"delete from sloth_tmp_int;\""))
-        return 1;
+    if (fclose(fp)) {
+        free(p);
+        return NULL;
+    }
 
-    if (time == NULL) {
-        if (sys_cmd
-            ("sqlite3 sloth_copy.db \"insert into sloth_tmp_int (i) "
-             "select strftime(\'%s\',\'now\');\""))
-            return 1;
-    } else {
-        if ((cmd = concat("sqlite3 sloth_copy.db ",
-                          "\"insert into sloth_tmp_int (i) values (\'",
-                          time, "\');\"", NULL)) == NULL)
-            return 1;
+    *(p + *fs) = '\0';
+    return p;
+}
 
-        if (sys_cmd(cmd)) {
-            free(cmd);
-            return 1;
-        }
-        free(cmd);
-    }
+int make_parent_dirs(char *file_path)
+{
+    /*
+     * Creates the missing parent directories of a file path.
+     * Paths in the database always use a forward slash.
+     */
+    char *p, *q, ch;
 
-    if (run_sql("sloth_copy.db", script_dir, "commit.sql"))
+    if ((p = strdup(file_path)) == NULL)
         return 1;
 
-    if (backup) {
-        /* Atomic on POSIX */
-        if (mv_file("sloth_copy.db", "sloth.db"))
-            return 1;
+    for (q = p + 1; *q != '\0'; ++q) {
+#ifdef _WIN32
+        if (*q == '/' || *q == '\\') {
+#else
+        if (*q == '/') {
+#endif
+            ch = *q;
+            *q = '\0';
+            /* Fails harmlessly if the directory already exists */
+            mkdir(p, 0777);
+            *q = ch;
+        }
     }
 
+    free(p);
     return 0;
 }
 
-void swap_ch(char *str, char old, char new)
+void stat_sig_func(sqlite3_context * ctx, int n, sqlite3_value ** v)
 {
     /*
-     * Replaces all old chars in a string str with new chars.
-     * str must be non-static.
+     * SQL function stat_sig(fn): Returns a signature of the stat data of a
+     * file, which changes when the file is modified. Returns NULL if the file
+     * cannot be stat'ed, or if it was modified so recently that another
+     * modification in the same second would not change the signature.
+     * Files with a NULL signature are always read.
      */
-    char *q = str;
-    while (*q != '\0') {
-        if (*q == old)
-            *q = new;
-        ++q;
-    }
-}
-
-int import_git(char *script_dir)
-{
-    FILE *fp;
-    size_t fs;
-    char *p = NULL;
+    char *fn;
+    struct stat st;
+    char sig[128];
 
-    char *hash;
-    char *time;
-    char *msg;
+    (void) n;
 
-    char *cmd;
-    if (sys_cmd("git log --reverse --pretty=format:%H^%at^%s > .log"))
-        return 1;
+    if ((fn = (char *) sqlite3_value_text(*v)) == NULL)
+        return;
 
-    if (filesize(".log", &fs))
-        return 1;
+    if (stat(fn, &st))
+        return;
 
-    if (AOF(fs, 1))
-        return 1;
+    if (st.st_mtime >= time(NULL) - 1 || st.st_ctime >= time(NULL) - 1)
+        return;
 
-    if ((p = malloc(fs + 1)) == NULL)
-        return 1;
-    *(p + fs) = '\0';
+    sprintf(sig, "%lu %lu %ld %ld", (unsigned long) st.st_size,
+            (unsigned long) st.st_ino, (long) st.st_mtime,
+            (long) st.st_ctime);
 
-    if ((fp = fopen(".log", "rb")) == NULL) {
-        free(p);
-        return 1;
-    }
+    sqlite3_result_text(ctx, sig, -1, SQLITE_TRANSIENT);
+}
 
-    if (fread(p, 1, fs, fp) != fs) {
-        free(p);
-        fclose(fp);
-        return 1;
-    }
+void sha256_func(sqlite3_context * ctx, int n, sqlite3_value ** v)
+{
+    /* SQL function sha256(d): Returns the SHA-256 hash of d as hex */
+    char hex[HASH_HEX_LEN + 1];
 
-    if (fclose(fp)) {
-        free(p);
-        return 1;
-    }
+    (void) n;
 
-    /* Backup */
-    if (cp_file("sloth.db", "sloth_copy.db")) {
-        free(p);
-        return 1;
-    }
+    if (sqlite3_value_type(*v) == SQLITE_NULL)
+        return;
 
-    /* Parse */
-    hash = strtok(p, "^\n");
-    do {
-        time = strtok(NULL, "^\n");
-        msg = strtok(NULL, "^\n");
+    sha256_hex((unsigned char *) sqlite3_value_blob(*v),
+               sqlite3_value_bytes(*v), hex);
 
-        /* Clean msg */
-        swap_ch(msg, '\'', ' ');
+    sqlite3_result_text(ctx, hex, HASH_HEX_LEN, SQLITE_TRANSIENT);
+}
 
-        printf("hash: %s\ntime: %s\nmsg: %s\n", hash, time, msg);
+int pack_data(ZSTD_CCtx * cctx, ZSTD_CDict * cdict, int level, char *d,
+              size_t s, char **z, size_t * zs, int *use_dict)
+{
+    /*
+     * Compresses s bytes at d with zstd. Data of up to DICT_FILE_MAX bytes
+     * is compressed with the dictionary cdict, if there is one. If this does
+     * not make the data smaller, then *z is set to NULL and the data should
+     * be stored raw. Must free *z after use. Returns 1 upon failure.
+     */
+    size_t cap, r;
 
-        if ((cmd = concat("git checkout ", hash, NULL)) == NULL) {
-            free(p);
-            return 1;
-        }
+    *z = NULL;
+    *use_dict = 0;
 
-        if (sys_cmd(cmd)) {
-            free(p);
-            return 1;
-        }
+    if (!s)
+        return 0;
 
-        if (sys_cmd("git ls-files > .track")) {
-            free(p);
-            return 1;
-        }
+    cap = ZSTD_compressBound(s);
+    if (!cap || ZSTD_isError(cap))
+        return 1;
 
-        if (sloth_commit(script_dir, msg, time, 0)) {
-            free(p);
-            return 1;
-        }
-    } while ((hash = strtok(NULL, "^\n")) != NULL);
+    if ((*z = malloc(cap)) == NULL)
+        return 1;
 
-    free(p);
-    free(cmd);
+    if (cdict != NULL && s <= DICT_FILE_MAX) {
+        *use_dict = 1;
+        r = ZSTD_compress_usingCDict(cctx, *z, cap, d, s, cdict);
+    } else {
+        r = ZSTD_compressCCtx(cctx, *z, cap, d, s, level);
+    }
 
-    /* Atomic on POSIX */
-    if (mv_file("sloth_copy.db", "sloth.db"))
-        return 1;
+    if (ZSTD_isError(r) || r >= s) {
+        free(*z);
+        *z = NULL;
+        *use_dict = 0;
+        return ZSTD_isError(r);
+    }
 
+    *zs = r;
     return 0;
 }
 
-void print_usage(char *prgm_name)
+unsigned char *put_varint(unsigned char *p, size_t x)
 {
-    fprintf(stderr, "Usage: %1$s init|log|diff|import|export|combine\n"
-            "%1$s subdir prefix_directory_name\n"
-            "%1$s combine path_to_other_sloth.db\n"
-            "%1$s commit msg [time]\n", prgm_name);
+    /* Writes x 7 bits at a time, low bits first. Returns the new end. */
+    while (x >= 0x80) {
+        *p++ = (unsigned char) (x & 0x7F) | 0x80;
+        x >>= 7;
+    }
+    *p++ = (unsigned char) x;
+    return p;
 }
 
-int main(int argc, char **argv)
+int get_varint(unsigned char **p, unsigned char *end, size_t * x)
+{
+    /* Reads a number written by put_varint. Returns 1 upon failure. */
+    size_t shift = 0;
+    *x = 0;
+    while (*p < end) {
+        if (shift >= sizeof(size_t) * CHAR_BIT)
+            return 1;
+        *x |= (size_t) (**p & 0x7F) << shift;
+        if (!(*(*p)++ & 0x80))
+            return 0;
+        shift += 7;
+    }
+    return 1;
+}
+
+int delta_emit(unsigned char **out, size_t * os, size_t * cap, int copy,
+               size_t a, unsigned char *lit, size_t n)
+{
+    /*
+     * Appends an instruction to a delta: Copy n bytes from offset a of the
+     * base, or insert the n literal bytes at lit. Returns 1 upon failure.
+     */
+    unsigned char *t, *p;
+    size_t need, new_cap;
+
+    if (!n)
+        return 0;
+
+    /* n fits in the varint of the instruction after the shift */
+    if (n > SIZE_MAX >> 1)
+        return 1;
+
+    need = VARINT_MAX * 2 + (copy ? 0 : n);
+    if (AOF(*os, need))
+        return 1;
+    if (*os + need > *cap) {
+        new_cap = *cap;
+        while (new_cap < *os + need) {
+            if (MOF(new_cap, 2))
+                return 1;
+            new_cap *= 2;
+        }
+        if ((t = realloc(*out, new_cap)) == NULL)
+            return 1;
+        *out = t;
+        *cap = new_cap;
+    }
+
+    p = put_varint(*out + *os, n << 1 | (copy ? 1 : 0));
+    if (copy) {
+        p = put_varint(p, a);
+    } else {
+        memcpy(p, lit, n);
+        p += n;
+    }
+    *os = p - *out;
+    return 0;
+}
+
+int make_delta(unsigned char *b, size_t bs, unsigned char *t, size_t ts,
+               unsigned char **out, size_t * os)
+{
+    /*
+     * Encodes t (the target) as a delta against b (the base), in the style
+     * of xdelta. The delta is the size of the target, followed by a list of
+     * instructions, which each start with a varint of the length shifted
+     * left by one:
+     *     Copy (low bit 1): The base offset follows as a varint.
+     *     Insert (low bit 0): The literal bytes follow.
+     * The base is indexed in blocks of DELTA_BLOCK bytes, and a rolling hash
+     * of the target is looked up at every position. Matches are extended
+     * in both directions. Must free *out after use. Returns 1 upon failure.
+     */
+    uint32_t *table = NULL;
+    size_t num_blocks, table_s = 1, cap, i, lit = 0, k, o, n;
+    uint32_t h = 0, pw = 1, slot;
+    int ret = 0;
+
+    *out = NULL;
+    *os = 0;
+
+    /* Block numbers are stored plus one in 32 bits, zero means empty */
+    num_blocks = bs / DELTA_BLOCK;
+    if (num_blocks >= UINT32_MAX)
+        return 1;
+    while (table_s < num_blocks) {
+        if (MOF(table_s, 2))
+            return 1;
+        table_s *= 2;
+    }
+    if (MOF(table_s, sizeof(uint32_t))
+        || (table = calloc(table_s, sizeof(uint32_t))) == NULL)
+        return 1;
+
+    for (k = 0; k < num_blocks; ++k) {
+        h = 0;
+        for (i = 0; i < DELTA_BLOCK; ++i)
+            h = h * DELTA_PRIME + *(b + k * DELTA_BLOCK + i);
+        slot = DELTA_SLOT(h, table_s);
+        /* Keep the first block with a hash */
+        if (!*(table + slot))
+            *(table + slot) = (uint32_t) k + 1;
+    }
+
+    cap = ts / 4 + VARINT_MAX * 4;
+    if ((*out = malloc(cap)) == NULL) {
+        ret = 1;
+        goto clean_up;
+    }
+    *os = put_varint(*out, ts) - *out;
+
+    for (i = 1; i < DELTA_BLOCK; ++i)
+        pw *= DELTA_PRIME;
+
+    i = 0;
+    if (ts >= DELTA_BLOCK)
+        for (h = 0, k = 0; k < DELTA_BLOCK; ++k)
+            h = h * DELTA_PRIME + *(t + k);
+
+    while (num_blocks && i + DELTA_BLOCK <= ts) {
+        slot = *(table + DELTA_SLOT(h, table_s));
+        if (slot && !memcmp(b + (slot - 1) * DELTA_BLOCK, t + i,
+                            DELTA_BLOCK)) {
+            o = (slot - 1) * DELTA_BLOCK;
+            /* Extend backwards into the pending literals */
+            while (i > lit && o && *(b + o - 1) == *(t + i - 1)) {
+                --i;
+                --o;
+            }
+            n = 0;
+            while (o + n < bs && i + n < ts && *(b + o + n) == *(t + i + n))
+                ++n;
+            if (delta_emit(out, os, &cap, 0, 0, t + lit, i - lit)
+                || delta_emit(out, os, &cap, 1, o, NULL, n)) {
+                ret = 1;
+                goto clean_up;
+            }
+            i += n;
+            lit = i;
+            if (i + DELTA_BLOCK <= ts)
+                for (h = 0, k = 0; k < DELTA_BLOCK; ++k)
+                    h = h * DELTA_PRIME + *(t + i + k);
+            continue;
+        }
+        /* Roll the hash forward one byte */
+        if (i + DELTA_BLOCK < ts)
+            h = (h - *(t + i) * pw) * DELTA_PRIME + *(t + i + DELTA_BLOCK);
+        ++i;
+    }
+
+    if (delta_emit(out, os, &cap, 0, 0, t + lit, ts - lit))
+        ret = 1;
+
+  clean_up:
+    free(table);
+    if (ret) {
+        free(*out);
+        *out = NULL;
+    }
+    return ret;
+}
+
+int apply_delta(unsigned char *b, size_t bs, unsigned char *d, size_t ds,
+                char **out, size_t * os)
+{
+    /*
+     * Reconstructs the target of a delta made by make_delta from its base.
+     * Must free *out after use. Returns 1 upon failure (a corrupt delta).
+     */
+    unsigned char *end = d + ds;
+    size_t ts, x, n, a, j = 0;
+
+    *out = NULL;
+
+    if (get_varint(&d, end, &ts) || (*out = malloc(ts ? ts : 1)) == NULL)
+        return 1;
+
+    while (d < end) {
+        if (get_varint(&d, end, &x))
+            goto fail;
+        n = x >> 1;
+        if (n > ts - j)
+            goto fail;
+        if (x & 1) {
+            if (get_varint(&d, end, &a) || a > bs || n > bs - a)
+                goto fail;
+            memcpy(*out + j, b + a, n);
+        } else {
+            if (n > (size_t) (end - d))
+                goto fail;
+            memcpy(*out + j, d, n);
+            d += n;
+        }
+        j += n;
+    }
+
+    if (j != ts)
+        goto fail;
+
+    *os = ts;
+    return 0;
+
+  fail:
+    free(*out);
+    *out = NULL;
+    return 1;
+}
+
+int pack_delta(ZSTD_CCtx * cctx, char *b, size_t bs, char *t, size_t ts,
+               int level, char **z, size_t * zs)
+{
+    /*
+     * Makes a delta of t against the base b, compressed with zstd.
+     * Must free *z after use. Returns 1 upon failure.
+     */
+    unsigned char *delta;
+    size_t ds, cap, r;
+
+    *z = NULL;
+
+    if (make_delta((unsigned char *) b, bs, (unsigned char *) t, ts, &delta,
+                   &ds))
+        return 1;
+
+    cap = ZSTD_compressBound(ds);
+    if (!cap || ZSTD_isError(cap) || (*z = malloc(cap)) == NULL) {
+        free(delta);
+        return 1;
+    }
+
+    r = ZSTD_compressCCtx(cctx, *z, cap, delta, ds, level);
+    free(delta);
+    if (ZSTD_isError(r)) {
+        free(*z);
+        *z = NULL;
+        return 1;
+    }
+
+    *zs = r;
+    return 0;
+}
+
+struct ddict *get_ddict(struct codec *cd, sqlite3 * db, sqlite3_int64 id)
+{
+    /*
+     * Returns a dictionary for decompression, loading it from sloth_dict
+     * the first time it is used. Returns NULL upon failure.
+     */
+    struct ddict *t;
+    sqlite3_stmt *stmt;
+
+    for (t = cd->dicts; t != NULL; t = t->next)
+        if (t->id == id)
+            return t;
+
+    if ((t = malloc(sizeof(struct ddict))) == NULL)
+        return NULL;
+
+    t->dd = NULL;
+    if (sqlite3_prepare_v2(db, "select d from sloth_dict where id = ?", -1,
+                           &stmt, NULL) == SQLITE_OK
+        && sqlite3_bind_int64(stmt, 1, id) == SQLITE_OK
+        && sqlite3_step(stmt) == SQLITE_ROW)
+        t->dd = ZSTD_createDDict(sqlite3_column_blob(stmt, 0),
+                                 sqlite3_column_bytes(stmt, 0));
+    sqlite3_finalize(stmt);
+
+    if (t->dd == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    t->id = id;
+    t->next = cd->dicts;
+    cd->dicts = t;
+    return t;
+}
+
+void free_codec(void *p)
+{
+    /* Frees the decompression state of a connection */
+    struct codec *cd = p;
+    struct ddict *t, *next;
+    struct blob_cache *c, *c_next;
+    if (cd == NULL)
+        return;
+    for (t = cd->dicts; t != NULL; t = next) {
+        next = t->next;
+        ZSTD_freeDDict(t->dd);
+        free(t);
+    }
+    for (c = cd->cache; c != NULL; c = c_next) {
+        c_next = c->next;
+        free(c->d);
+        free(c);
+    }
+    ZSTD_freeDCtx(cd->dctx);
+    free(cd);
+}
+
+int cache_get(struct codec *cd, const char *h, char **d, size_t * s)
+{
+    /*
+     * Copies a blob out of the reconstruction cache, moving it to the front.
+     * Returns 1 if it is not cached (or upon failure).
+     */
+    struct blob_cache *c, *prev = NULL;
+
+    for (c = cd->cache; c != NULL; prev = c, c = c->next) {
+        if (!strcmp(c->h, h)) {
+            if ((*d = malloc(c->s ? c->s : 1)) == NULL)
+                return 1;
+            memcpy(*d, c->d, c->s);
+            *s = c->s;
+            if (prev != NULL) {
+                prev->next = c->next;
+                c->next = cd->cache;
+                cd->cache = c;
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void cache_put(struct codec *cd, const char *h, char *d, size_t s)
+{
+    /*
+     * Adds a copy of a reconstructed blob to the front of the cache, then
+     * drops the least recently used blobs to keep within CACHE_MAX bytes.
+     * Caching is best effort, so failures are ignored.
+     */
+    struct blob_cache *c, *prev;
+
+    if (s > CACHE_MAX / 4 || (c = malloc(sizeof(struct blob_cache))) == NULL)
+        return;
+    if ((c->d = malloc(s ? s : 1)) == NULL) {
+        free(c);
+        return;
+    }
+    memcpy(c->d, d, s);
+    c->s = s;
+    strcpy(c->h, h);
+    c->next = cd->cache;
+    cd->cache = c;
+    cd->cache_s += s;
+
+    while (cd->cache_s > CACHE_MAX) {
+        for (prev = NULL, c = cd->cache; c->next != NULL; prev = c,
+             c = c->next);
+        prev->next = NULL;
+        cd->cache_s -= c->s;
+        free(c->d);
+        free(c);
+    }
+}
+
+int unzstd(ZSTD_DCtx * dctx, ZSTD_DDict * dd, const void *z, size_t zs,
+           char **p, size_t * s)
+{
+    /*
+     * Decompresses a zstd frame, with the dictionary dd if it is not NULL.
+     * Must free *p after use. Returns 1 upon failure.
+     */
+    uint64_t fcs;
+    size_t r;
+
+    fcs = ZSTD_getFrameContentSize(z, zs);
+    if (fcs == ZSTD_CONTENTSIZE_ERROR || fcs == ZSTD_CONTENTSIZE_UNKNOWN
+        || fcs > SIZE_MAX || (*p = malloc(fcs ? fcs : 1)) == NULL)
+        return 1;
+
+    if (dd != NULL)
+        r = ZSTD_decompress_usingDDict(dctx, *p, fcs, z, zs, dd);
+    else
+        r = ZSTD_decompressDCtx(dctx, *p, fcs, z, zs);
+
+    if (ZSTD_isError(r) || r != fcs) {
+        free(*p);
+        *p = NULL;
+        return 1;
+    }
+
+    *s = fcs;
+    return 0;
+}
+
+int get_total(sqlite3 * db, char *sql, const char *x, size_t * total)
+{
+    /*
+     * Runs a query that returns a single size, binding x to the first
+     * parameter. Returns 1 upon failure, or if the size does not fit.
+     */
+    sqlite3_stmt *stmt;
+    sqlite3_int64 v;
+    int ret = 1;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK
+        && sqlite3_bind_text(stmt, 1, x, -1, SQLITE_STATIC) == SQLITE_OK
+        && sqlite3_step(stmt) == SQLITE_ROW) {
+        v = sqlite3_column_int64(stmt, 0);
+        if (v >= 0 && (uint64_t) v <= SIZE_MAX) {
+            *total = (size_t) v;
+            ret = 0;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+int load_blob(struct codec *cd, sqlite3 * db, const char *h, int level,
+              char **d, size_t * s)
+{
+    /*
+     * Reads the raw data of the blob with hash h into *d, decompressing it,
+     * applying its delta chain, or joining its chunks, as needed. Delta
+     * results are cached, so reading successive versions of a file only
+     * applies one delta each. Sets *d to NULL if there is no such blob.
+     * level is the position in the chain, which bounds the recursion.
+     * Returns 1 upon failure.
+     */
+    int ret = 0;
+    sqlite3_stmt *stmt = NULL;
+    struct ddict *dict = NULL;
+    char base_h[HASH_HEX_LEN + 1];
+    char *delta = NULL, *base = NULL;
+    size_t ds, bs;
+    int enc;
+
+    *d = NULL;
+
+    if (level > DELTA_MAX_DEPTH)
+        return 1;
+
+    if (!cache_get(cd, h, d, s))
+        return 0;
+
+    if (sqlite3_prepare_v2(db, "select d, enc, dict_id, base_h "
+                           "from sloth_blob where h = ?", -1, &stmt,
+                           NULL) != SQLITE_OK
+        || sqlite3_bind_text(stmt, 1, h, -1, SQLITE_STATIC) != SQLITE_OK) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    if ((enc = sqlite3_step(stmt)) != SQLITE_ROW) {
+        if (enc != SQLITE_DONE)
+            ret = 1;
+        goto clean_up;
+    }
+
+    enc = sqlite3_column_int(stmt, 1);
+    if (enc == ENC_RAW) {
+        *s = sqlite3_column_bytes(stmt, 0);
+        if ((*d = malloc(*s ? *s : 1)) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        /* A zero-length blob comes back as a NULL pointer */
+        if (*s)
+            memcpy(*d, sqlite3_column_blob(stmt, 0), *s);
+    } else if (enc == ENC_ZSTD) {
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL
+            && (dict = get_ddict(cd, db, sqlite3_column_int64(stmt, 2)))
+            == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        if (unzstd(cd->dctx, dict != NULL ? dict->dd : NULL,
+                   sqlite3_column_blob(stmt, 0),
+                   sqlite3_column_bytes(stmt, 0), d, s)) {
+            ret = 1;
+            goto clean_up;
+        }
+    } else if (enc == ENC_DELTA) {
+        if (sqlite3_column_bytes(stmt, 3) != HASH_HEX_LEN
+            || unzstd(cd->dctx, NULL, sqlite3_column_blob(stmt, 0),
+                      sqlite3_column_bytes(stmt, 0), &delta, &ds)) {
+            ret = 1;
+            goto clean_up;
+        }
+        strcpy(base_h, (char *) sqlite3_column_text(stmt, 3));
+        /* Release the row before following the chain */
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        if (load_blob(cd, db, base_h, level + 1, &base, &bs) || base == NULL
+            || apply_delta((unsigned char *) base, bs,
+                           (unsigned char *) delta, ds, d, s)) {
+            ret = 1;
+            goto clean_up;
+        }
+        cache_put(cd, h, *d, *s);
+    } else if (enc == ENC_CHUNKED) {
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        if (get_total(db, "select coalesce(sum(s), 0) from sloth_chunk "
+                      "where h = ?", h, s)
+            || (*d = malloc(*s ? *s : 1)) == NULL
+            || sqlite3_prepare_v2(db, "select chunk_h, s from sloth_chunk "
+                                  "where h = ? order by i", -1, &stmt,
+                                  NULL) != SQLITE_OK
+            || sqlite3_bind_text(stmt, 1, h, -1, SQLITE_STATIC) != SQLITE_OK) {
+            ret = 1;
+            goto clean_up;
+        }
+        ds = 0;
+        while ((enc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (load_blob(cd, db, (char *) sqlite3_column_text(stmt, 0),
+                          level + 1, &base, &bs) || base == NULL
+                || bs != (size_t) sqlite3_column_int64(stmt, 1)
+                || bs > *s - ds) {
+                ret = 1;
+                goto clean_up;
+            }
+            memcpy(*d + ds, base, bs);
+            ds += bs;
+            free(base);
+            base = NULL;
+        }
+        if (enc != SQLITE_DONE || ds != *s)
+            ret = 1;
+    } else {
+        ret = 1;
+    }
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    free(delta);
+    free(base);
+    if (ret) {
+        free(*d);
+        *d = NULL;
+    }
+    return ret;
+}
+
+void blob_data_func(sqlite3_context * ctx, int n, sqlite3_value ** v)
+{
+    /*
+     * SQL function blob_data(h): Returns the raw data of the blob with
+     * hash h, decompressing it and applying its delta chain if needed.
+     * Returns NULL if there is no such blob. All reads of blob data go
+     * through this function.
+     */
+    const char *h;
+    char *d;
+    size_t s;
+
+    (void) n;
+
+    if ((h = (const char *) sqlite3_value_text(*v)) == NULL)
+        return;
+
+    if (load_blob(sqlite3_user_data(ctx), sqlite3_context_db_handle(ctx), h,
+                  0, &d, &s)) {
+        sqlite3_result_error(ctx, "blob_data: Cannot decode blob", -1);
+        return;
+    }
+
+    if (d == NULL)
+        return;
+
+    if (!s) {
+        free(d);
+        sqlite3_result_zeroblob(ctx, 0);
+        return;
+    }
+
+    sqlite3_result_blob64(ctx, d, s, free);
+}
+
+int write_blob(struct codec *cd, sqlite3 * db, const char *h, FILE * fp,
+               size_t * s)
+{
+    /*
+     * Writes the raw data of the blob with hash h to fp, and stores its
+     * size in s. A chunked blob is written one chunk at a time, so it is
+     * never held in memory whole. Returns 1 upon failure.
+     */
+    sqlite3_stmt *stmt = NULL;
+    char *d = NULL;
+    size_t ds;
+    int r, ret = 0;
+
+    *s = 0;
+
+    if (sqlite3_prepare_v2(db, "select chunk_h from sloth_chunk "
+                           "where h = ? order by i", -1, &stmt,
+                           NULL) != SQLITE_OK
+        || sqlite3_bind_text(stmt, 1, h, -1, SQLITE_STATIC) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 1;
+    }
+
+    /* Blobs that are not chunked have no rows */
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (load_blob(cd, db, (char *) sqlite3_column_text(stmt, 0), 1, &d,
+                      &ds) || d == NULL || fwrite(d, 1, ds, fp) != ds) {
+            ret = 1;
+            goto clean_up;
+        }
+        *s += ds;
+        free(d);
+        d = NULL;
+    }
+    if (r != SQLITE_DONE) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (!*s) {
+        if (load_blob(cd, db, h, 0, &d, &ds) || d == NULL
+            || fwrite(d, 1, ds, fp) != ds)
+            ret = 1;
+        *s = ds;
+    }
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    free(d);
+    return ret;
+}
+
+void writeblob_func(sqlite3_context * ctx, int n, sqlite3_value ** v)
+{
+    /*
+     * SQL function writeblob(fn, h): Writes the raw data of the blob with
+     * hash h to a file, creating any missing parent directories. Large
+     * chunked blobs are streamed. Returns the number of bytes written.
+     */
+    char *fn;
+    const char *h;
+    size_t s;
+    FILE *fp;
+
+    (void) n;
+
+    if ((fn = (char *) sqlite3_value_text(*v)) == NULL
+        || (h = (const char *) sqlite3_value_text(*(v + 1))) == NULL) {
+        sqlite3_result_error(ctx, "writeblob: NULL argument", -1);
+        return;
+    }
+
+    if ((fp = fopen(fn, "wb")) == NULL) {
+        if (make_parent_dirs(fn) || (fp = fopen(fn, "wb")) == NULL) {
+            sqlite3_result_error(ctx, "writeblob: Cannot open file", -1);
+            return;
+        }
+    }
+
+    if (write_blob(sqlite3_user_data(ctx), sqlite3_context_db_handle(ctx),
+                   h, fp, &s)) {
+        fclose(fp);
+        sqlite3_result_error(ctx, "writeblob: Write failed", -1);
+        return;
+    }
+
+    if (fclose(fp)) {
+        sqlite3_result_error(ctx, "writeblob: Write failed", -1);
+        return;
+    }
+
+    sqlite3_result_int64(ctx, (sqlite3_int64) s);
+}
+
+sqlite3 *open_db(char *db_name)
+{
+    /*
+     * Opens a sloth database and registers the SQL functions that the
+     * scripts use. Returns NULL upon failure.
+     */
+    sqlite3 *db;
+    struct codec *cd;
+
+    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", db_name, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    if (sqlite3_create_function(db, "stat_sig", 1, SQLITE_UTF8, NULL,
+                                stat_sig_func, NULL, NULL) != SQLITE_OK
+        || sqlite3_create_function(db, "sha256", 1,
+                                   SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                   sha256_func, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", db_name, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    if ((cd = malloc(sizeof(struct codec))) == NULL) {
+        sqlite3_close(db);
+        return NULL;
+    }
+    cd->dicts = NULL;
+    cd->cache = NULL;
+    cd->cache_s = 0;
+    if ((cd->dctx = ZSTD_createDCtx()) == NULL) {
+        free(cd);
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    /* The codec is freed when the connection is closed (or upon failure) */
+    if (sqlite3_create_function_v2(db, "blob_data", 1, SQLITE_UTF8, cd,
+                                   blob_data_func, NULL, NULL,
+                                   free_codec) != SQLITE_OK
+        || sqlite3_create_function(db, "writeblob", 2, SQLITE_UTF8, cd,
+                                   writeblob_func, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", db_name, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+int exec_sql(sqlite3 * db, char *sql, char *x)
+{
+    /*
+     * Runs a single SQL statement that does not return rows.
+     * If x is not NULL, then it is bound to the first parameter.
+     */
+    sqlite3_stmt *stmt;
+    int r;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    if (x != NULL)
+        r = sqlite3_bind_text(stmt, 1, x, -1, SQLITE_STATIC);
+    else
+        r = SQLITE_OK;
+
+    if (r == SQLITE_OK)
+        r = sqlite3_step(stmt);
+
+    if (r != SQLITE_DONE)
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+
+    sqlite3_finalize(stmt);
+    return r != SQLITE_DONE;
+}
+
+int print_row(sqlite3_stmt * stmt, FILE * fp)
+{
+    /*
+     * Writes a row of query output. Columns are separated by COL_SEP and
+     * the row is terminated by ROW_SEP. Values are written unchanged.
+     */
+    int i, n = sqlite3_column_count(stmt);
+    const void *d;
+    size_t s;
+
+    for (i = 0; i < n; ++i) {
+        if (i && putc(COL_SEP, fp) == EOF)
+            return 1;
+        if (sqlite3_column_type(stmt, i) == SQLITE_NULL) {
+            if (fputs(NULL_STR, fp) == EOF)
+                return 1;
+        } else {
+            d = sqlite3_column_blob(stmt, i);
+            s = sqlite3_column_bytes(stmt, i);
+            if (fwrite(d, 1, s, fp) != s)
+                return 1;
+        }
+    }
+
+    if (putc(ROW_SEP, fp) == EOF)
+        return 1;
+
+    return 0;
+}
+
+int import_file(sqlite3 * db, char *fn, char *table)
+{
+    /*
+     * Imports a file into a table. Each line is a row, and the columns in
+     * a line are separated by COL_SEP. Empty lines are skipped.
+     */
+    int ret = 0;
+    char *data;
+    char *sql = NULL;
+    char *line, *next, *q;
+    size_t fs, num_cols = 0, n, i, len;
+    sqlite3_stmt *stmt = NULL;
+
+    if ((data = read_file(fn, &fs)) == NULL)
+        return 1;
+
+    line = data;
+    while (*line != '\0') {
+        if ((q = strchr(line, ROW_SEP)) != NULL) {
+            *q = '\0';
+            next = q + 1;
+        } else {
+            next = line + strlen(line);
+        }
+
+        if (*line != '\0') {
+            /* Count the columns */
+            n = 1;
+            for (q = line; *q != '\0'; ++q)
+                if (*q == COL_SEP)
+                    ++n;
+
+            if (stmt == NULL) {
+                /* Prepare the insert using the columns of the first row */
+                num_cols = n;
+                len = strlen(table);
+                if (MOF(num_cols, 2) || AOF(len, num_cols * 2)
+                    || AOF(len + num_cols * 2, 32)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+                if ((sql = malloc(len + num_cols * 2 + 32)) == NULL) {
+                    ret = 1;
+                    goto clean_up;
+                }
+                sprintf(sql, "insert into %s values (?", table);
+                for (i = 1; i < num_cols; ++i)
+                    strcat(sql, ",?");
+                strcat(sql, ")");
+                if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) !=
+                    SQLITE_OK) {
+                    fprintf(stderr, "%s: %s\n", fn, sqlite3_errmsg(db));
+                    ret = 1;
+                    goto clean_up;
+                }
+            }
+
+            if (n != num_cols) {
+                fprintf(stderr, "%s: Expected %lu columns\n", fn,
+                        (unsigned long) num_cols);
+                ret = 1;
+                goto clean_up;
+            }
+
+            /* Bind the columns */
+            for (i = 1; i <= num_cols; ++i) {
+                if ((q = strchr(line, COL_SEP)) != NULL)
+                    *q = '\0';
+                if (sqlite3_bind_text(stmt, i, line, -1, SQLITE_STATIC) !=
+                    SQLITE_OK) {
+                    ret = 1;
+                    goto clean_up;
+                }
+                if (q != NULL)
+                    line = q + 1;
+            }
+
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                fprintf(stderr, "%s: %s\n", fn, sqlite3_errmsg(db));
+                ret = 1;
+                goto clean_up;
+            }
+            sqlite3_reset(stmt);
+        }
+
+        line = next;
+    }
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    free(sql);
+    free(data);
+    return ret;
+}
+
+size_t num_cpus(void)
+{
+    /* Returns the number of online processors (at least 1) */
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors ? si.dwNumberOfProcessors : 1;
+#elif defined _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n;
+#else
+    return 1;
+#endif
+}
+
+void clean_data(char *d, size_t * s)
+{
+    /*
+     * Removes problem characters from file data in place:
+     * Carriage Return (\r, ^M) and the null character (\0, ^@).
+     */
+    size_t i, j = 0;
+    for (i = 0; i < *s; ++i)
+        if (*(d + i) != '\r' && *(d + i) != '\0')
+            *(d + j++) = *(d + i);
+    *s = j;
+}
+
+int hash_file(char *fn, char *h)
+{
+    /*
+     * Hashes the cleaned data of a file, reading it in pieces, so that a
+     * large file is never held in memory whole. Returns 1 upon failure.
+     */
+    FILE *fp;
+    unsigned char *b;
+    size_t r;
+    struct sha256_ctx ctx;
+    int ret = 0;
+
+    if ((b = malloc(CDC_MAX)) == NULL)
+        return 1;
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        free(b);
+        return 1;
+    }
+
+    sha256_init(&ctx);
+    while ((r = fread(b, 1, CDC_MAX, fp)) != 0) {
+        clean_data((char *) b, &r);
+        sha256_update(&ctx, b, r);
+    }
+    if (ferror(fp))
+        ret = 1;
+    sha256_final(&ctx, h);
+
+    if (fclose(fp))
+        ret = 1;
+    free(b);
+    return ret;
+}
+
+void init_gear(void)
+{
+    /*
+     * Fills the gear table of the chunking rolling hash with fixed
+     * pseudo-random values (xorshift32). The values must never change, as
+     * they decide the chunk boundaries, and so the deduplication.
+     */
+    uint32_t x = 0x9e3779b9;
+    size_t i;
+    if (*gear)
+        return;
+    for (i = 0; i < 256; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *(gear + i) = x;
+    }
+}
+
+size_t cdc_cut(unsigned char *p, size_t n)
+{
+    /*
+     * Returns the length of the first content-defined chunk of the n bytes
+     * at p (FastCDC). The boundary is where the gear hash of the preceding
+     * bytes has all of its mask bits clear. A stricter mask is used before
+     * CDC_AVG than after, which normalises the chunk sizes. The caller must
+     * supply at least CDC_MAX bytes, unless it is at the end of the data.
+     */
+    uint32_t fp = 0;
+    size_t i, normal = CDC_AVG, end = n;
+
+    if (n <= CDC_MIN)
+        return n;
+    if (end > CDC_MAX)
+        end = CDC_MAX;
+    if (normal > end)
+        normal = end;
+
+    for (i = CDC_MIN; i < normal; ++i) {
+        fp = (fp << 1) + *(gear + *(p + i));
+        if (!(fp & CDC_MASK_S))
+            return i + 1;
+    }
+    for (; i < end; ++i) {
+        fp = (fp << 1) + *(gear + *(p + i));
+        if (!(fp & CDC_MASK_L))
+            return i + 1;
+    }
+    return end;
+}
+
+int store_chunked(sqlite3 * db, ZSTD_CCtx * cctx, FILE * fp, size_t left,
+                  char *name, char *h)
+{
+    /*
+     * Streams large data through content-defined chunking. The next left
+     * bytes of fp (or the rest of it, if left is SIZE_MAX) are read and
+     * cleaned in pieces, and each chunk that is not stored yet is
+     * compressed and stored as a blob of its own. The blob itself
+     * (ENC_CHUNKED) lists its chunks in sloth_chunk. Memory use is bounded
+     * by the chunk size, not the data size. The hash is written to h, and
+     * name is only used in messages. Must be called inside of a
+     * transaction. Returns 1 upon failure.
+     */
+    int ret = 0;
+    unsigned char *b = NULL;
+    char *z = NULL;
+    struct chunk *list = NULL, *t;
+    size_t num = 0, cap = 0, bl = 0, r, n, zs, i, want;
+    sqlite3_stmt *sel = NULL, *ins = NULL;
+    struct sha256_ctx ctx;
+    int eof = 0, use_dict;
+
+    init_gear();
+    sha256_init(&ctx);
+
+    if ((b = malloc(CDC_MAX * 2)) == NULL) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (sqlite3_prepare_v2(db, "select 1 from sloth_blob where h = ?", -1,
+                           &sel, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "insert into sloth_blob (h, d, enc) "
+                              "values (?, ?, ?)", -1, &ins,
+                              NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+
+    while (1) {
+        /* Top up the buffer, so that a whole chunk can be cut */
+        while (!eof && bl < CDC_MAX) {
+            want = CDC_MAX * 2 - bl;
+            if (left < want)
+                want = left;
+            r = fread(b + bl, 1, want, fp);
+            if (left != SIZE_MAX)
+                left -= r;
+            if (r < want) {
+                /* Only the end of a whole file is expected */
+                if (ferror(fp) || left != SIZE_MAX) {
+                    fprintf(stderr, "%s: Cannot read data\n", name);
+                    ret = 1;
+                    goto clean_up;
+                }
+                eof = 1;
+            } else if (!left) {
+                eof = 1;
+            }
+            clean_data((char *) b + bl, &r);
+            bl += r;
+        }
+
+        if (!bl)
+            break;
+
+        n = cdc_cut(b, bl);
+        sha256_update(&ctx, b, n);
+
+        if (num == cap) {
+            cap = cap ? cap * 2 : 256;
+            if (MOF(cap, sizeof(struct chunk))
+                || (t = realloc(list, cap * sizeof(struct chunk))) == NULL) {
+                ret = 1;
+                goto clean_up;
+            }
+            list = t;
+        }
+        t = list + num++;
+        sha256_hex(b, n, t->h);
+        t->s = n;
+
+        /* Store the chunk, unless it is already stored */
+        if (sqlite3_bind_text(sel, 1, t->h, HASH_HEX_LEN, SQLITE_STATIC)
+            != SQLITE_OK || (r = sqlite3_step(sel)) == SQLITE_ERROR) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(sel);
+        if (r == SQLITE_DONE) {
+            if (pack_data(cctx, NULL, COMMIT_LEVEL, (char *) b, n, &z, &zs,
+                          &use_dict)) {
+                fprintf(stderr, "%s: Cannot compress data\n", name);
+                ret = 1;
+                goto clean_up;
+            }
+            if (sqlite3_bind_text(ins, 1, t->h, HASH_HEX_LEN,
+                                  SQLITE_STATIC) != SQLITE_OK
+                || (z != NULL
+                    ? sqlite3_bind_blob64(ins, 2, z, zs, SQLITE_STATIC)
+                    : sqlite3_bind_blob64(ins, 2, b, n,
+                                          SQLITE_STATIC)) != SQLITE_OK
+                || sqlite3_bind_int(ins, 3,
+                                    z != NULL ? ENC_ZSTD : ENC_RAW) !=
+                SQLITE_OK || sqlite3_step(ins) != SQLITE_DONE) {
+                fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+                ret = 1;
+                goto clean_up;
+            }
+            sqlite3_reset(ins);
+            free(z);
+            z = NULL;
+        }
+
+        memmove(b, b + n, bl - n);
+        bl -= n;
+    }
+
+    sha256_final(&ctx, h);
+
+    /* Store the file blob and its chunk list, unless it is already stored */
+    if (sqlite3_bind_text(sel, 1, h, HASH_HEX_LEN, SQLITE_STATIC)
+        != SQLITE_OK || (r = sqlite3_step(sel)) == SQLITE_ERROR) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    if (r == SQLITE_ROW)
+        goto clean_up;
+
+    if (sqlite3_bind_text(ins, 1, h, HASH_HEX_LEN, SQLITE_STATIC)
+        != SQLITE_OK || sqlite3_bind_zeroblob(ins, 2, 0) != SQLITE_OK
+        || sqlite3_bind_int(ins, 3, ENC_CHUNKED) != SQLITE_OK
+        || sqlite3_step(ins) != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    sqlite3_finalize(ins);
+    ins = NULL;
+
+    if (sqlite3_prepare_v2(db, "insert into sloth_chunk (h, i, chunk_h, s) "
+                           "values (?, ?, ?, ?)", -1, &ins,
+                           NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    for (i = 0; i < num; ++i) {
+        if (sqlite3_bind_text(ins, 1, h, HASH_HEX_LEN, SQLITE_STATIC)
+            != SQLITE_OK
+            || sqlite3_bind_int64(ins, 2, (sqlite3_int64) i) != SQLITE_OK
+            || sqlite3_bind_text(ins, 3, (list + i)->h, HASH_HEX_LEN,
+                                 SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_bind_int64(ins, 4,
+                                  (sqlite3_int64) (list + i)->s) != SQLITE_OK
+            || sqlite3_step(ins) != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(ins);
+    }
+
+  clean_up:
+    sqlite3_finalize(sel);
+    sqlite3_finalize(ins);
+    free(b);
+    free(z);
+    free(list);
+    return ret;
+}
+
+int stage_chunked(sqlite3 * db, ZSTD_CCtx * cctx, struct stage_job *j)
+{
+    /*
+     * Streams a large file through store_chunked, and sets the hash of the
+     * job. Returns 1 upon failure.
+     */
+    FILE *fp;
+    int ret;
+
+    if ((fp = fopen(j->fn, "rb")) == NULL) {
+        fprintf(stderr, "%s: Cannot read file\n", j->fn);
+        return 1;
+    }
+    ret = store_chunked(db, cctx, fp, SIZE_MAX, j->fn, j->h);
+    if (fclose(fp))
+        ret = 1;
+    return ret;
+}
+
+#ifdef _WIN32
+DWORD WINAPI stage_worker(LPVOID arg)
+#else
+void *stage_worker(void *arg)
+#endif
+{
+    /*
+     * Staging thread: Takes jobs from the pool until there are none left.
+     * In phase 1 each file is read, cleaned and hashed, except for large
+     * files, which are left to stage_chunked (or streamed through hash_file
+     * when only hashing). In phase 2 the data of the new blobs is
+     * compressed, or stored as a delta against the last version of the file
+     * when that is smaller.
+     */
+    struct stage_pool *sp = arg;
+    struct stage_job *j;
+    ZSTD_CCtx *cctx = NULL;
+    char *z, *dz;
+    size_t zs, dzs, fs, i;
+    int use_dict;
+
+    if (sp->phase == 2)
+        cctx = ZSTD_createCCtx();
+
+    while (1) {
+        LOCK_MUTEX(&sp->mutex);
+        i = sp->next++;
+        UNLOCK_MUTEX(&sp->mutex);
+
+        if (i >= sp->n)
+            break;
+
+        j = sp->job + i;
+        if (sp->phase == 1) {
+            if (filesize(j->fn, &fs)) {
+                if (sp->hash_only && errno == ENOENT)
+                    j->missing = 1;
+                else
+                    j->err = 1;
+                continue;
+            }
+            if (fs >= CHUNK_FILE_MIN) {
+                if (sp->hash_only && hash_file(j->fn, j->h))
+                    j->err = 1;
+                else
+                    j->chunked = !sp->hash_only;
+                continue;
+            }
+            if ((j->d = read_file(j->fn, &j->s)) == NULL) {
+                j->err = 1;
+                continue;
+            }
+            clean_data(j->d, &j->s);
+            sha256_hex((unsigned char *) j->d, j->s, j->h);
+            if (sp->hash_only) {
+                free(j->d);
+                j->d = NULL;
+            }
+        } else if (j->is_new) {
+            dz = NULL;
+            if (cctx == NULL
+                || (j->base != NULL
+                    && pack_delta(cctx, j->base, j->base_s, j->d, j->s,
+                                  COMMIT_LEVEL, &dz, &dzs))
+                || pack_data(cctx, sp->cdict, COMMIT_LEVEL, j->d, j->s, &z,
+                             &zs, &use_dict)) {
+                free(dz);
+                j->err = 2;
+                continue;
+            }
+            free(j->base);
+            j->base = NULL;
+            /* Keep whichever of the delta and the full blob is smaller */
+            if (dz != NULL && dzs < (z != NULL ? zs : j->s)) {
+                free(z);
+                free(j->d);
+                j->d = dz;
+                j->s = dzs;
+                j->enc = ENC_DELTA;
+            } else {
+                free(dz);
+                *j->base_h = '\0';
+                j->depth = 0;
+                if (z != NULL) {
+                    free(j->d);
+                    j->d = z;
+                    j->s = zs;
+                    j->enc = ENC_ZSTD;
+                    j->use_dict = use_dict;
+                }
+            }
+        }
+    }
+
+    ZSTD_freeCCtx(cctx);
+    return 0;
+}
+
+void run_threads(thread_fn worker, void *arg, size_t n)
+{
+    /*
+     * Runs worker(arg) on up to a thread per processor, but no more than n,
+     * and waits for them to finish.
+     */
+    size_t num_threads = 0, i;
+#ifdef _WIN32
+    HANDLE th[MAX_THREADS];
+#else
+    pthread_t th[MAX_THREADS];
+#endif
+
+    while (num_threads < MAX_THREADS && num_threads < num_cpus()
+           && num_threads < n) {
+#ifdef _WIN32
+        if ((*(th + num_threads) =
+             CreateThread(NULL, 0, worker, arg, 0, NULL)) == NULL)
+            break;
+#else
+        if (pthread_create(th + num_threads, NULL, worker, arg))
+            break;
+#endif
+        ++num_threads;
+    }
+
+    /* The main thread helps too, which also covers thread creation failing */
+    worker(arg);
+
+    for (i = 0; i < num_threads; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(*(th + i), INFINITE);
+        CloseHandle(*(th + i));
+#else
+        pthread_join(*(th + i), NULL);
+#endif
+    }
+}
+
+void run_pool(struct stage_pool *sp, int phase)
+{
+    /* Runs all of the jobs in the pool through one phase */
+    sp->phase = phase;
+    sp->next = 0;
+    run_threads(stage_worker, sp, sp->n);
+}
+
+int pack_jobs(sqlite3 * db, struct stage_pool *sp)
+{
+    /*
+     * Compresses the data of the hashed jobs whose blobs are not in the
+     * repository yet, using the latest repository dictionary for small
+     * files, or as a delta against the last version of the file. The
+     * hashes, and the encoded data of the new blobs, are stored in the
+     * sloth_stage rows of the jobs, and the data is freed. The mutex of the
+     * pool must be set up. Returns 1 upon failure.
+     */
+    int ret = 0;
+    sqlite3_stmt *stmt = NULL;
+    struct stage_job *t;
+    sqlite3_int64 dict_id = 0;
+    size_t i;
+    int r;
+
+    sp->cdict = NULL;
+
+    /* Only compress the blobs that are not in the repository yet */
+    if (sqlite3_prepare_v2(db, "select 1 from sloth_blob where h = ?", -1,
+                           &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    for (i = 0; i < sp->n; ++i) {
+        t = sp->job + i;
+        if (sqlite3_bind_text(stmt, 1, t->h, HASH_HEX_LEN, SQLITE_STATIC)
+            != SQLITE_OK) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        r = sqlite3_step(stmt);
+        if (r == SQLITE_ROW) {
+            free(t->d);
+            t->d = NULL;
+        } else if (r == SQLITE_DONE) {
+            t->is_new = 1;
+        } else {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    /*
+     * Load the last version of each new file in the delta size range, as
+     * the base of a delta. Keyframes (full blobs) bound the chain length.
+     * Chunked blobs (ENC_CHUNKED) are too large to be bases.
+     */
+    if (sqlite3_prepare_v2(db, "select b.h, b.depth, blob_data(b.h) "
+                           "from sloth_blob as b where b.enc <> ? and b.h = "
+                           "(select a.h from sloth_file as a where a.fn = ? "
+                           "order by a.entry_t desc limit 1)", -1, &stmt,
+                           NULL) != SQLITE_OK
+        || sqlite3_bind_int(stmt, 1, ENC_CHUNKED) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    for (i = 0; i < sp->n; ++i) {
+        t = sp->job + i;
+        if (!t->is_new || t->s < DELTA_FILE_MIN || t->s > DELTA_FILE_MAX)
+            continue;
+        if (sqlite3_bind_text(stmt, 2, t->fn, -1, SQLITE_STATIC)
+            != SQLITE_OK) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        r = sqlite3_step(stmt);
+        if (r == SQLITE_ROW) {
+            t->base_s = sqlite3_column_bytes(stmt, 2);
+            if (sqlite3_column_int(stmt, 1) < DELTA_MAX_DEPTH
+                && t->base_s >= DELTA_FILE_MIN
+                && t->base_s <= DELTA_FILE_MAX) {
+                if ((t->base = malloc(t->base_s)) == NULL) {
+                    ret = 1;
+                    goto clean_up;
+                }
+                memcpy(t->base, sqlite3_column_blob(stmt, 2), t->base_s);
+                strcpy(t->base_h, (char *) sqlite3_column_text(stmt, 0));
+                t->depth = sqlite3_column_int(stmt, 1) + 1;
+            }
+        } else if (r != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    /* Load the latest dictionary, if there is one */
+    if (sqlite3_prepare_v2(db, "select id, d from sloth_dict "
+                           "order by id desc limit 1", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    if ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        dict_id = sqlite3_column_int64(stmt, 0);
+        if ((sp->cdict = ZSTD_createCDict(sqlite3_column_blob(stmt, 1),
+                                          sqlite3_column_bytes(stmt, 1),
+                                          COMMIT_LEVEL)) == NULL) {
+            fprintf(stderr, "Cannot load dictionary\n");
+            ret = 1;
+            goto clean_up;
+        }
+    } else if (r != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    /* Phase 2: Compress */
+    run_pool(sp, 2);
+
+    /* Store the results */
+    if (sqlite3_prepare_v2(db, "update sloth_stage "
+                           "set d = ?, h = ?, enc = ?, dict_id = ?, "
+                           "base_h = ?, depth = ? where fn = ?", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    for (i = 0; i < sp->n; ++i) {
+        t = sp->job + i;
+        if (t->err) {
+            fprintf(stderr, "%s: Cannot compress file\n", t->fn);
+            ret = 1;
+            goto clean_up;
+        }
+        /* Existing blobs are only referenced by their hash */
+        if ((t->is_new ? sqlite3_bind_blob64(stmt, 1, t->d, t->s,
+                                             SQLITE_STATIC)
+             : sqlite3_bind_null(stmt, 1)) != SQLITE_OK
+            || sqlite3_bind_text(stmt, 2, t->h, HASH_HEX_LEN,
+                                 SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_bind_int(stmt, 3, t->enc) != SQLITE_OK
+            || (t->use_dict ? sqlite3_bind_int64(stmt, 4, dict_id)
+                : sqlite3_bind_null(stmt, 4)) != SQLITE_OK
+            || (*t->base_h != '\0'
+                ? sqlite3_bind_text(stmt, 5, t->base_h, HASH_HEX_LEN,
+                                    SQLITE_STATIC)
+                : sqlite3_bind_null(stmt, 5)) != SQLITE_OK
+            || sqlite3_bind_int(stmt, 6, t->depth) != SQLITE_OK
+            || sqlite3_bind_text(stmt, 7, t->fn, -1,
+                                 SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(stmt);
+        /* Free the data as soon as it is in the database */
+        free(t->d);
+        t->d = NULL;
+    }
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    ZSTD_freeCDict(sp->cdict);
+    sp->cdict = NULL;
+    return ret;
+}
+
+int stage_files(sqlite3 * db, int hash_only)
+{
+    /*
+     * Reads, cleans and hashes the staged files that do not have a hash yet
+     * (the files that have changed), spread across a pool of threads.
+     * The data of blobs that are not in the repository yet is then
+     * compressed, using the latest repository dictionary for small files,
+     * or stored as a delta against the last version of the file.
+     * The hashes, and the encoded data of the new blobs, are stored in
+     * sloth_stage. The files are taken in batches of up to STAGE_BATCH_MAX
+     * bytes, so that memory use does not grow with the number of changes.
+     * If hash_only is set, only the hashes are stored, and nothing is added
+     * to the repository. Files that do not exist are then left without a
+     * hash, rather than failing.
+     */
+    int ret = 0;
+    sqlite3_stmt *stmt = NULL;
+    struct stage_pool sp;
+    struct stage_job *job = NULL, *t;
+    size_t num = 0, cap = 0, new_cap, start, end, held, fs, i;
+    ZSTD_CCtx *cctx = NULL;
+    int r, mutex_on = 0;
+
+    sp.hash_only = hash_only;
+
+    /* Collect the jobs */
+    if (sqlite3_prepare_v2(db, "select fn from sloth_stage where h is null",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (num == cap) {
+            if (MOF(cap, 2)) {
+                ret = 1;
+                goto clean_up;
+            }
+            new_cap = cap ? cap * 2 : 64;
+            if (MOF(new_cap, sizeof(struct stage_job))) {
+                ret = 1;
+                goto clean_up;
+            }
+            if ((t = realloc(job, new_cap * sizeof(struct stage_job)))
+                == NULL) {
+                ret = 1;
+                goto clean_up;
+            }
+            job = t;
+            cap = new_cap;
+        }
+        t = job + num;
+        t->d = NULL;
+        t->base = NULL;
+        *t->base_h = '\0';
+        t->depth = 0;
+        t->chunked = 0;
+        t->is_new = 0;
+        t->enc = ENC_RAW;
+        t->use_dict = 0;
+        t->err = 0;
+        t->missing = 0;
+        if ((t->fn = strdup((char *) sqlite3_column_text(stmt, 0))) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        ++num;
+    }
+    if (r != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    if (!num)
+        goto clean_up;
+
+#ifdef _WIN32
+    InitializeCriticalSection(&sp.mutex);
+#else
+    if (pthread_mutex_init(&sp.mutex, NULL)) {
+        ret = 1;
+        goto clean_up;
+    }
+#endif
+    mutex_on = 1;
+
+    if (hash_only && sqlite3_prepare_v2(db, "update sloth_stage set h = ? "
+                                        "where fn = ?", -1, &stmt,
+                                        NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+
+    for (start = 0; start < num; start = end) {
+        /*
+         * Only hashing does not keep the data. Large files are streamed,
+         * and files that cannot be read fail in phase 1, so neither counts.
+         */
+        held = 0;
+        for (end = start; end < num; ++end) {
+            if (hash_only || filesize((job + end)->fn, &fs)
+                || fs >= CHUNK_FILE_MIN)
+                continue;
+            if (end != start && held + fs > STAGE_BATCH_MAX)
+                break;
+            held += fs;
+        }
+        sp.job = job + start;
+        sp.n = end - start;
+
+        /* Phase 1: Read, clean and hash */
+        run_pool(&sp, 1);
+        for (i = 0; i < sp.n; ++i) {
+            if ((sp.job + i)->err) {
+                fprintf(stderr, "%s: Cannot read file\n", (sp.job + i)->fn);
+                ret = 1;
+                goto clean_up;
+            }
+        }
+
+        if (hash_only) {
+            for (i = 0; i < sp.n; ++i) {
+                t = sp.job + i;
+                if (t->missing)
+                    continue;
+                if (sqlite3_bind_text(stmt, 1, t->h, HASH_HEX_LEN,
+                                      SQLITE_STATIC) != SQLITE_OK
+                    || sqlite3_bind_text(stmt, 2, t->fn, -1,
+                                         SQLITE_STATIC) != SQLITE_OK
+                    || sqlite3_step(stmt) != SQLITE_DONE) {
+                    fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+                    ret = 1;
+                    goto clean_up;
+                }
+                sqlite3_reset(stmt);
+            }
+            continue;
+        }
+
+        /* Large files are streamed, one at a time */
+        for (i = 0; i < sp.n; ++i) {
+            t = sp.job + i;
+            if (!t->chunked)
+                continue;
+            if (cctx == NULL && (cctx = ZSTD_createCCtx()) == NULL) {
+                ret = 1;
+                goto clean_up;
+            }
+            if (stage_chunked(db, cctx, t)) {
+                ret = 1;
+                goto clean_up;
+            }
+        }
+
+        if (pack_jobs(db, &sp)) {
+            ret = 1;
+            goto clean_up;
+        }
+    }
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    if (mutex_on) {
+#ifdef _WIN32
+        DeleteCriticalSection(&sp.mutex);
+#else
+        pthread_mutex_destroy(&sp.mutex);
+#endif
+    }
+    ZSTD_freeCCtx(cctx);
+    for (i = 0; i < num; ++i) {
+        free((job + i)->fn);
+        free((job + i)->d);
+        free((job + i)->base);
+    }
+    free(job);
+    return ret;
+}
+
+#ifdef _WIN32
+DWORD WINAPI checkout_worker(LPVOID arg)
+#else
+void *checkout_worker(void *arg)
+#endif
+{
+    /*
+     * Checkout thread: Writes the files of the pool until there are none
+     * left. Each thread reads the repository through a connection of its
+     * own, so that blobs are decoded in parallel, and chunked blobs are
+     * streamed to the file. Jobs that are not done keep their error flag.
+     */
+    struct checkout_pool *cp = arg;
+    struct checkout_job *j;
+    sqlite3 *db;
+    sqlite3_stmt *stmt = NULL;
+    size_t i;
+
+    if ((db = open_db("sloth.db")) == NULL)
+        return 0;
+
+    if (sqlite3_prepare_v2(db, "select writeblob(?, ?)", -1, &stmt, NULL)
+        != SQLITE_OK) {
+        sqlite3_close(db);
+        return 0;
+    }
+
+    while (1) {
+        LOCK_MUTEX(&cp->mutex);
+        i = cp->next++;
+        UNLOCK_MUTEX(&cp->mutex);
+
+        if (i >= cp->n)
+            break;
+
+        j = cp->job + i;
+        if (*j->h == '\0')
+            continue;
+        if (sqlite3_bind_text(stmt, 1, j->fn, -1, SQLITE_STATIC) == SQLITE_OK
+            && sqlite3_bind_text(stmt, 2, j->h, HASH_HEX_LEN,
+                                 SQLITE_STATIC) == SQLITE_OK
+            && sqlite3_step(stmt) == SQLITE_ROW)
+            j->err = 0;
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return 0;
+}
+
+int checkout_files(sqlite3 * db, int *changed)
+{
+    /*
+     * Carries out the checkout planned in sloth_checkout (fn, h, tracked,
+     * dirty), where a NULL hash means that the file is deleted. Nothing is
+     * changed if a file with local changes, or an untracked file, would be
+     * lost. Files are deleted first, along with the directories that become
+     * empty, and then written by a pool of threads. The changes that were
+     * made are marked as done, even if others failed, and *changed is set
+     * once the working tree has been touched.
+     * Must not be called inside of a transaction, as the threads read the
+     * repository through connections of their own. Returns 1 upon failure.
+     */
+    int ret = 0;
+    sqlite3_stmt *stmt = NULL;
+    struct checkout_pool cp;
+    struct checkout_job *t;
+    size_t cap = 0, new_cap, i;
+    struct stat st;
+    char *p = NULL, *q;
+    int r, lost = 0, mutex_on = 0, in_trans = 0;
+
+    *changed = 0;
+    cp.job = NULL;
+    cp.n = 0;
+    cp.next = 0;
+
+    if (sqlite3_prepare_v2(db, "select fn, h, tracked, dirty "
+                           "from sloth_checkout order by fn", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (cp.n == cap) {
+            if (MOF(cap, 2)) {
+                ret = 1;
+                goto clean_up;
+            }
+            new_cap = cap ? cap * 2 : 64;
+            if (MOF(new_cap, sizeof(struct checkout_job))) {
+                ret = 1;
+                goto clean_up;
+            }
+            if ((t = realloc(cp.job, new_cap * sizeof(struct checkout_job)))
+                == NULL) {
+                ret = 1;
+                goto clean_up;
+            }
+            cp.job = t;
+            cap = new_cap;
+        }
+        t = cp.job + cp.n;
+        if ((t->fn = strdup((char *) sqlite3_column_text(stmt, 0))) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        ++cp.n;
+        if (sqlite3_column_bytes(stmt, 1) == HASH_HEX_LEN)
+            strcpy(t->h, (char *) sqlite3_column_text(stmt, 1));
+        else
+            *t->h = '\0';
+        t->tracked = sqlite3_column_int(stmt, 2);
+        t->dirty = sqlite3_column_int(stmt, 3);
+        t->err = 1;
+
+        if (t->dirty) {
+            fprintf(stderr, "%s: Local changes would be lost\n", t->fn);
+            lost = 1;
+        } else if (!t->tracked && !stat(t->fn, &st)) {
+            fprintf(stderr, "%s: Untracked file would be overwritten\n",
+                    t->fn);
+            lost = 1;
+        }
+    }
+    if (r != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    if (lost) {
+        ret = 1;
+        goto clean_up;
+    }
+
+#ifdef _WIN32
+    InitializeCriticalSection(&cp.mutex);
+#else
+    if (pthread_mutex_init(&cp.mutex, NULL)) {
+        ret = 1;
+        goto clean_up;
+    }
+#endif
+    mutex_on = 1;
+
+    /* Deletions first, as a file can make way for a directory */
+    *changed = 1;
+    for (i = 0; i < cp.n; ++i) {
+        t = cp.job + i;
+        if (*t->h != '\0')
+            continue;
+        if (remove(t->fn) && errno != ENOENT) {
+            fprintf(stderr, "%s: Cannot delete file\n", t->fn);
+            ret = 1;
+            break;
+        }
+        t->err = 0;
+        /* Remove the parent directories that are now empty */
+        if ((p = strdup(t->fn)) == NULL) {
+            ret = 1;
+            break;
+        }
+        while ((q = strrchr(p, '/')) != NULL) {
+            *q = '\0';
+            if (rmdir(p))
+                break;
+        }
+        free(p);
+        p = NULL;
+    }
+
+    if (!ret) {
+        run_threads(checkout_worker, &cp, cp.n);
+
+        for (i = 0; i < cp.n; ++i) {
+            t = cp.job + i;
+            if (*t->h != '\0' && t->err) {
+                fprintf(stderr, "%s: Cannot write file\n", t->fn);
+                ret = 1;
+            }
+        }
+    }
+
+    /* Mark what was done, so that the index can follow the working tree */
+    if (exec_sql(db, "begin", NULL)) {
+        ret = 1;
+        goto clean_up;
+    }
+    in_trans = 1;
+    if (sqlite3_prepare_v2(db, "update sloth_checkout set done = 1 "
+                           "where fn = ?", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    for (i = 0; i < cp.n; ++i) {
+        t = cp.job + i;
+        if (t->err)
+            continue;
+        if (sqlite3_bind_text(stmt, 1, t->fn, -1, SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (exec_sql(db, "commit", NULL)) {
+        ret = 1;
+        goto clean_up;
+    }
+    in_trans = 0;
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    if (in_trans && exec_sql(db, "rollback", NULL))
+        ret = 1;
+    if (mutex_on) {
+#ifdef _WIN32
+        DeleteCriticalSection(&cp.mutex);
+#else
+        pthread_mutex_destroy(&cp.mutex);
+#endif
+    }
+    free(p);
+    for (i = 0; i < cp.n; ++i)
+        free((cp.job + i)->fn);
+    free(cp.job);
+    return ret;
+}
+
+int repack(sqlite3 * db)
+{
+    /*
+     * Trains a new zstd dictionary on the small blobs of the repository,
+     * then recompresses every raw or zstd blob at a high level, the
+     * small ones with the new dictionary. Dictionaries that are no longer
+     * used are deleted.
+     * Must be called inside of a transaction.
+     */
+    int ret = 0;
+    sqlite3_stmt *stmt = NULL, *upd = NULL;
+    char *samples = NULL, *dict = NULL, *d, *z = NULL;
+    size_t *sizes = NULL, *t;
+    size_t num = 0, cap = 0, total = 0, s, zs, ds;
+    ZSTD_CCtx *cctx = NULL;
+    ZSTD_CDict *cdict = NULL;
+    sqlite3_int64 dict_id = 0;
+    int r, use_dict;
+
+    if ((samples = malloc(DICT_SAMPLE_MAX)) == NULL
+        || (dict = malloc(DICT_CAP)) == NULL
+        || (cctx = ZSTD_createCCtx()) == NULL) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    /*
+     * Gather training samples from the small blobs. The stored size is a
+     * quick filter, as compression never makes a blob bigger.
+     */
+    if (sqlite3_prepare_v2(db, "select blob_data(h) from sloth_blob "
+                           "where enc in (0, 1) and length(d) <= ? "
+                           "order by random()", -1,
+                           &stmt, NULL) != SQLITE_OK
+        || sqlite3_bind_int(stmt, 1, DICT_FILE_MAX) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        s = sqlite3_column_bytes(stmt, 0);
+        if (!s || s > DICT_FILE_MAX || s > DICT_SAMPLE_MAX - total)
+            continue;
+        if (num == cap) {
+            cap = cap ? cap * 2 : 1024;
+            if ((t = realloc(sizes, cap * sizeof(size_t))) == NULL) {
+                ret = 1;
+                goto clean_up;
+            }
+            sizes = t;
+        }
+        memcpy(samples + total, sqlite3_column_blob(stmt, 0), s);
+        total += s;
+        *(sizes + num++) = s;
+    }
+    if (r != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    /* Training fails when there is not enough data, which is not an error */
+    ds = num ? ZDICT_trainFromBuffer(dict, DICT_CAP, samples, sizes,
+                                     (unsigned int) num) : 0;
+    free(samples);
+    samples = NULL;
+    if (!num || ZDICT_isError(ds)) {
+        fprintf(stderr, "Not enough data to train a dictionary\n");
+    } else {
+        if (sqlite3_prepare_v2(db, "insert into sloth_dict (d) values (?)",
+                               -1, &stmt, NULL) != SQLITE_OK
+            || sqlite3_bind_blob64(stmt, 1, dict, ds,
+                                   SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        dict_id = sqlite3_last_insert_rowid(db);
+        if ((cdict = ZSTD_createCDict(dict, ds, REPACK_LEVEL)) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+    }
+
+    /* Recompress every blob */
+    /*
+     * Deltas (ENC_DELTA) stay as they are, their bases keep their hashes.
+     * Chunked blobs (ENC_CHUNKED) have no data, their chunks are repacked.
+     */
+    if (exec_sql(db, "create temp table sloth_repack as "
+                 "select h from sloth_blob where enc in (0, 1);", NULL)) {
+        ret = 1;
+        goto clean_up;
+    }
+    if (sqlite3_prepare_v2(db, "select h, blob_data(h) from sloth_repack",
+                           -1, &stmt, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "update sloth_blob "
+                              "set d = ?, enc = ?, dict_id = ? where h = ?",
+                              -1, &upd, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        s = sqlite3_column_bytes(stmt, 1);
+        /* A zero-length blob comes back as a NULL pointer */
+        if ((d = (char *) sqlite3_column_blob(stmt, 1)) == NULL)
+            d = "";
+        if (pack_data(cctx, cdict, REPACK_LEVEL, d, s, &z, &zs, &use_dict)) {
+            fprintf(stderr, "%s: Cannot compress blob\n",
+                    sqlite3_column_text(stmt, 0));
+            ret = 1;
+            goto clean_up;
+        }
+        if ((z != NULL ? sqlite3_bind_blob64(upd, 1, z, zs, SQLITE_STATIC)
+             : sqlite3_bind_blob64(upd, 1, d, s, SQLITE_STATIC)) != SQLITE_OK
+            || sqlite3_bind_int(upd, 2,
+                                z != NULL ? ENC_ZSTD : ENC_RAW) != SQLITE_OK
+            || (use_dict ? sqlite3_bind_int64(upd, 3, dict_id)
+                : sqlite3_bind_null(upd, 3)) != SQLITE_OK
+            || sqlite3_bind_text(upd, 4, (char *) sqlite3_column_text(stmt, 0),
+                                 -1, SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_step(upd) != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(upd);
+        free(z);
+        z = NULL;
+    }
+    if (r != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    if (exec_sql(db, "drop table sloth_repack;", NULL)
+        || exec_sql(db, "delete from sloth_dict where id not in "
+                    "(select a.dict_id from sloth_blob as a "
+                    "where a.dict_id is not null);", NULL))
+        ret = 1;
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(upd);
+    free(z);
+    free(samples);
+    free(dict);
+    free(sizes);
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeCCtx(cctx);
+    return ret;
+}
+
+int path_cmp(const void *a, const void *b)
+{
+    /*
+     * Orders tree items by path, component by component, so that the
+     * contents of each directory are contiguous ('/' sorts before any other
+     * character). Within a directory this is the byte order of the names.
+     */
+    const unsigned char *p = (unsigned char *) ((struct tree_item *) a)->fn;
+    const unsigned char *q = (unsigned char *) ((struct tree_item *) b)->fn;
+    int x, y;
+
+    while (*p != '\0' && *p == *q) {
+        ++p;
+        ++q;
+    }
+    x = *p == '/' ? 1 : *p ? *p + 1 : 0;
+    y = *q == '/' ? 1 : *q ? *q + 1 : 0;
+    return x - y;
+}
+
+int store_tree(struct tree_ctx *tc, struct tree_entry *e, size_t num,
+               char *hex)
+{
+    /*
+     * Hashes a tree over its num entries, which must be ordered by name,
+     * then files before subtrees:
+     *     "d name\0hash\n" for a subtree, "f name\0hash\n" for a file.
+     * Trees are stored in sloth_tree unless they are already stored, so
+     * unchanged directories are shared between commits. The hash is
+     * written to hex. Returns 1 upon failure.
+     */
+    struct tree_entry *t;
+    struct sha256_ctx ctx;
+    size_t i;
+    int r;
+
+    sha256_init(&ctx);
+    for (i = 0; i < num; ++i) {
+        t = e + i;
+        sha256_update(&ctx, (unsigned char *) (t->is_dir ? "d " : "f "), 2);
+        sha256_update(&ctx, (unsigned char *) t->name, t->len);
+        sha256_update(&ctx, (unsigned char *) "", 1);
+        sha256_update(&ctx, (unsigned char *) t->h, HASH_HEX_LEN);
+        sha256_update(&ctx, (unsigned char *) "\n", 1);
+    }
+    sha256_final(&ctx, hex);
+
+    if (sqlite3_bind_text(tc->sel, 1, hex, HASH_HEX_LEN, SQLITE_STATIC)
+        != SQLITE_OK || (r = sqlite3_step(tc->sel)) == SQLITE_ERROR)
+        return 1;
+    sqlite3_reset(tc->sel);
+    if (r == SQLITE_ROW)
+        return 0;
+
+    if (sqlite3_bind_text(tc->ins_tree, 1, hex, HASH_HEX_LEN, SQLITE_STATIC)
+        != SQLITE_OK || sqlite3_step(tc->ins_tree) != SQLITE_DONE)
+        return 1;
+    sqlite3_reset(tc->ins_tree);
+
+    for (i = 0; i < num; ++i) {
+        t = e + i;
+        if (sqlite3_bind_text(tc->ins_entry, 1, hex, HASH_HEX_LEN,
+                              SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_bind_text(tc->ins_entry, 2, t->name, t->len,
+                                 SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_bind_int(tc->ins_entry, 3, t->is_dir) != SQLITE_OK
+            || sqlite3_bind_text(tc->ins_entry, 4, t->h, HASH_HEX_LEN,
+                                 SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_step(tc->ins_entry) != SQLITE_DONE)
+            return 1;
+        sqlite3_reset(tc->ins_entry);
+    }
+
+    return 0;
+}
+
+int build_tree(struct tree_ctx *tc, struct tree_item *item, size_t n,
+               size_t off, char *hex)
+{
+    /*
+     * Builds the tree of a directory from its n sorted items, whose paths
+     * all start with the first off chars (the directory path). Subtrees
+     * are built first, then the tree is stored, see store_tree. The hash
+     * is written to hex. Returns 1 upon failure.
+     */
+    int ret = 0;
+    struct tree_entry *e = NULL, *t;
+    size_t num = 0, cap = 0, i = 0, j, len;
+    char *name, *slash;
+
+    while (i < n) {
+        name = (item + i)->fn + off;
+        if (num == cap) {
+            cap = cap ? cap * 2 : 16;
+            if (MOF(cap, sizeof(struct tree_entry))
+                || (t = realloc(e, cap * sizeof(struct tree_entry))) == NULL) {
+                ret = 1;
+                goto clean_up;
+            }
+            e = t;
+        }
+        t = e + num++;
+        t->name = name;
+        if ((slash = strchr(name, '/')) == NULL) {
+            t->len = strlen(name);
+            t->is_dir = 0;
+            strcpy(t->h, (item + i)->h);
+            ++i;
+        } else {
+            len = slash - name;
+            /* The directory runs while the paths share the name and '/' */
+            for (j = i + 1; j < n
+                 && !strncmp((item + j)->fn + off, name, len + 1); ++j);
+            t->len = len;
+            t->is_dir = 1;
+            if (build_tree(tc, item + i, j - i, off + len + 1, t->h)) {
+                ret = 1;
+                goto clean_up;
+            }
+            i = j;
+        }
+    }
+
+    if (store_tree(tc, e, num, hex))
+        ret = 1;
+
+  clean_up:
+    free(e);
+    return ret;
+}
+
+int init_tree_ctx(sqlite3 * db, struct tree_ctx *tc)
+{
+    /* Prepares the statements used to store trees. Returns 1 upon failure. */
+    tc->sel = NULL;
+    tc->ins_tree = NULL;
+    tc->ins_entry = NULL;
+
+    if (sqlite3_prepare_v2(db, "select 1 from sloth_tree where h = ?", -1,
+                           &tc->sel, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "insert into sloth_tree (h) values (?)",
+                              -1, &tc->ins_tree, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "insert into sloth_tree_entry "
+                              "(tree_h, name, is_dir, h) "
+                              "values (?, ?, ?, ?)", -1, &tc->ins_entry,
+                              NULL) != SQLITE_OK)
+        return 1;
+
+    return 0;
+}
+
+void free_tree_ctx(struct tree_ctx *tc)
+{
+    sqlite3_finalize(tc->sel);
+    sqlite3_finalize(tc->ins_tree);
+    sqlite3_finalize(tc->ins_entry);
+}
+
+int make_tree(sqlite3 * db, sqlite3_stmt * rows, char *root)
+{
+    /*
+     * Builds the manifest of a snapshot, given a statement that returns
+     * its (fn, h) rows, and writes the root tree hash to root.
+     * Returns 1 upon failure.
+     */
+    int ret = 0;
+    struct tree_ctx tc;
+    struct tree_item *item = NULL, *t;
+    size_t n = 0, cap = 0, i;
+    int r;
+
+    tc.sel = NULL;
+    tc.ins_tree = NULL;
+    tc.ins_entry = NULL;
+
+    while ((r = sqlite3_step(rows)) == SQLITE_ROW) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            if (MOF(cap, sizeof(struct tree_item))
+                || (t = realloc(item, cap * sizeof(struct tree_item)))
+                == NULL) {
+                ret = 1;
+                goto clean_up;
+            }
+            item = t;
+        }
+        t = item + n;
+        if (sqlite3_column_bytes(rows, 1) != HASH_HEX_LEN
+            || (t->fn = strdup((char *) sqlite3_column_text(rows, 0)))
+            == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        strcpy(t->h, (char *) sqlite3_column_text(rows, 1));
+        ++n;
+    }
+    if (r != SQLITE_DONE) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    qsort(item, n, sizeof(struct tree_item), path_cmp);
+
+    if (init_tree_ctx(db, &tc) || build_tree(&tc, item, n, 0, root)) {
+        ret = 1;
+        goto clean_up;
+    }
+
+  clean_up:
+    if (ret)
+        fprintf(stderr, "Cannot build tree: %s\n", sqlite3_errmsg(db));
+    free_tree_ctx(&tc);
+    for (i = 0; i < n; ++i)
+        free((item + i)->fn);
+    free(item);
+    return ret;
+}
+
+int tree_stage(sqlite3 * db)
+{
+    /*
+     * Builds the manifest of the files in sloth_stage, and stores the root
+     * hash in sloth_tmp_root. Returns 1 upon failure.
+     */
+    sqlite3_stmt *stmt;
+    char root[HASH_HEX_LEN + 1];
+    int ret;
+
+    if (sqlite3_prepare_v2(db, "select fn, h from sloth_stage", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    ret = make_tree(db, stmt, root);
+    sqlite3_finalize(stmt);
+
+    if (ret || exec_sql(db, "delete from sloth_tmp_root", NULL)
+        || exec_sql(db, "insert into sloth_tmp_root (h) values (?)", root))
+        return 1;
+
+    return 0;
+}
+
+int tree_roots(sqlite3 * db)
+{
+    /*
+     * Builds the manifests of the commits that do not have a root hash,
+     * from their snapshots in sloth_file. Returns 1 upon failure.
+     */
+    int ret = 0;
+    sqlite3_stmt *sel = NULL, *rows = NULL, *upd = NULL;
+    char root[HASH_HEX_LEN + 1];
+    sqlite3_int64 t;
+    int r;
+
+    /* Commits are collected first, as they are updated along the way */
+    if (exec_sql(db, "create temp table sloth_root_todo as "
+                 "select t from sloth_commit where root_h is null;", NULL))
+        return 1;
+
+    if (sqlite3_prepare_v2(db, "select t from sloth_root_todo", -1, &sel,
+                           NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "select a.fn, a.h from sloth_file as a "
+                              "where a.id in (select z.id "
+                              "from sloth_file_time as z "
+                              "where z.entry_t <= ?1 and z.exit_t > ?1) "
+                              "and ?1 >= a.entry_t and ?1 < a.exit_t", -1,
+                              &rows, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "update sloth_commit set root_h = ? "
+                              "where t = ?", -1, &upd, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+
+    while ((r = sqlite3_step(sel)) == SQLITE_ROW) {
+        t = sqlite3_column_int64(sel, 0);
+        if (sqlite3_bind_int64(rows, 1, t) != SQLITE_OK
+            || make_tree(db, rows, root)
+            || sqlite3_bind_text(upd, 1, root, HASH_HEX_LEN,
+                                 SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_bind_int64(upd, 2, t) != SQLITE_OK
+            || sqlite3_step(upd) != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(rows);
+        sqlite3_reset(upd);
+    }
+    if (r != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    sqlite3_finalize(sel);
+    sel = NULL;
+
+    if (exec_sql(db, "drop table sloth_root_todo;", NULL))
+        ret = 1;
+
+  clean_up:
+    sqlite3_finalize(sel);
+    sqlite3_finalize(rows);
+    sqlite3_finalize(upd);
+    return ret;
+}
+
+int load_tree(sqlite3 * db, const char *h, struct tree_entry **e,
+              size_t * n)
+{
+    /*
+     * Loads the entries of a tree, ordered by name. A NULL h is an empty
+     * tree. The names are allocated, see free_tree. Returns 1 upon failure.
+     */
+    sqlite3_stmt *stmt = NULL;
+    struct tree_entry *t;
+    size_t cap = 0;
+    int r, ret = 0;
+
+    *e = NULL;
+    *n = 0;
+
+    if (h == NULL)
+        return 0;
+
+    if (sqlite3_prepare_v2(db, "select name, is_dir, h "
+                           "from sloth_tree_entry where tree_h = ? "
+                           "order by name, is_dir", -1, &stmt,
+                           NULL) != SQLITE_OK
+        || sqlite3_bind_text(stmt, 1, h, -1, SQLITE_STATIC) != SQLITE_OK) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 16;
+            if (MOF(cap, sizeof(struct tree_entry))
+                || (t = realloc(*e, cap * sizeof(struct tree_entry)))
+                == NULL) {
+                ret = 1;
+                goto clean_up;
+            }
+            *e = t;
+        }
+        t = *e + *n;
+        if ((t->name = strdup((char *) sqlite3_column_text(stmt, 0)))
+            == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        ++*n;
+        t->len = strlen(t->name);
+        t->is_dir = sqlite3_column_int(stmt, 1);
+        strncpy(t->h, (char *) sqlite3_column_text(stmt, 2), HASH_HEX_LEN);
+        *(t->h + HASH_HEX_LEN) = '\0';
+    }
+    if (r != SQLITE_DONE)
+        ret = 1;
+
+  clean_up:
+    if (ret)
+        fprintf(stderr, "Cannot load tree: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+void free_tree(struct tree_entry *e, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        free((e + i)->name);
+    free(e);
+}
+
+int entry_cmp(const void *a, const void *b)
+{
+    /* Orders tree entries by name, then files before subtrees */
+    const struct tree_entry *x = a, *y = b;
+    int c;
+
+    if ((c = strcmp(x->name, y->name)) != 0)
+        return c;
+    return x->is_dir - y->is_dir;
+}
+
+int tree_update(sqlite3 * db, struct tree_ctx *tc, const char *h,
+                struct tree_item *item, size_t n, size_t off, char *hex)
+{
+    /*
+     * Applies n changes, sorted by path_cmp, to the tree h (NULL is an
+     * empty tree), whose paths all start with the first off chars (the
+     * directory path). A change with an empty hash deletes the file. Only
+     * the subtrees that the changes fall in are loaded and stored again,
+     * so the cost follows the size of the change, not the size of the
+     * snapshot. The new hash is written to hex, or an empty string if a
+     * subdirectory ends up empty. Returns 1 upon failure.
+     */
+    int ret = 0;
+    struct tree_entry *e = NULL, *t, key;
+    size_t num, orig, cap, i = 0, j, k, len;
+    char *name, *slash, sub[HASH_HEX_LEN + 1];
+
+    if (load_tree(db, h, &e, &num)) {
+        ret = 1;
+        goto clean_up;
+    }
+    orig = num;
+    cap = num;
+
+    while (i < n) {
+        name = (item + i)->fn + off;
+        if ((slash = strchr(name, '/')) == NULL) {
+            len = strlen(name);
+            j = i + 1;
+        } else {
+            len = slash - name;
+            /* The directory runs while the paths share the name and '/' */
+            for (j = i + 1; j < n
+                 && !strncmp((item + j)->fn + off, name, len + 1); ++j);
+        }
+
+        if ((key.name = malloc(len + 1)) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        memcpy(key.name, name, len);
+        *(key.name + len) = '\0';
+        key.is_dir = slash != NULL;
+
+        /* Only the entries as loaded are sorted, the new ones come after */
+        t = orig ? bsearch(&key, e, orig, sizeof(struct tree_entry),
+                           entry_cmp) : NULL;
+        if (slash == NULL) {
+            strcpy(sub, (item + i)->h);
+        } else if (tree_update(db, tc, t != NULL ? t->h : NULL, item + i,
+                               j - i, off + len + 1, sub)) {
+            free(key.name);
+            ret = 1;
+            goto clean_up;
+        }
+
+        if (t != NULL) {
+            /* An empty hash marks the entry as deleted */
+            strcpy(t->h, sub);
+            free(key.name);
+        } else if (*sub != '\0') {
+            if (num == cap) {
+                cap = cap ? cap * 2 : 16;
+                if (MOF(cap, sizeof(struct tree_entry))
+                    || (t = realloc(e, cap * sizeof(struct tree_entry)))
+                    == NULL) {
+                    free(key.name);
+                    ret = 1;
+                    goto clean_up;
+                }
+                e = t;
+            }
+            t = e + num++;
+            t->name = key.name;
+            t->len = len;
+            t->is_dir = key.is_dir;
+            strcpy(t->h, sub);
+        } else {
+            free(key.name);
+        }
+        i = j;
+    }
+
+    /* Drop the deleted entries, and put the new ones in order */
+    for (i = 0, k = 0; i < num; ++i) {
+        if (*(e + i)->h == '\0')
+            free((e + i)->name);
+        else
+            *(e + k++) = *(e + i);
+    }
+    num = k;
+    qsort(e, num, sizeof(struct tree_entry), entry_cmp);
+
+    if (!num && off)
+        *hex = '\0';
+    else if (store_tree(tc, e, num, hex))
+        ret = 1;
+
+  clean_up:
+    free_tree(e, num);
+    return ret;
+}
+
+int tree_diff(sqlite3 * db, const char *h1, const char *h2, char *prefix,
+              change_fn cb, void *arg)
+{
+    /*
+     * Compares two trees (either may be NULL, an empty tree), calling cb for
+     * every file that was added ('A'), deleted ('D') or modified ('M'), in
+     * path order. Subtrees with equal hashes are skipped without being
+     * loaded, so the cost follows the size of the change, not the size of
+     * the snapshots. prefix is the directory path of the trees, "" at the
+     * root. Returns 1 upon failure, or if cb fails.
+     */
+    int ret = 0;
+    struct tree_entry *e1 = NULL, *e2 = NULL, *a, *b;
+    size_t n1 = 0, n2 = 0, i = 0, j = 0;
+    char *path = NULL;
+    int c;
+
+    if (h1 != NULL && h2 != NULL && !strcmp(h1, h2))
+        return 0;
+
+    if (load_tree(db, h1, &e1, &n1) || load_tree(db, h2, &e2, &n2)) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    while (i < n1 || j < n2) {
+        a = i < n1 ? e1 + i : NULL;
+        b = j < n2 ? e2 + j : NULL;
+        if (a == NULL)
+            c = 1;
+        else if (b == NULL)
+            c = -1;
+        else if ((c = strcmp(a->name, b->name)) == 0)
+            c = a->is_dir - b->is_dir;
+
+        free(path);
+        if ((path = concat(prefix, c <= 0 ? a->name : b->name, NULL))
+            == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+
+        if (c == 0) {
+            if (strcmp(a->h, b->h)) {
+                if (a->is_dir) {
+                    /* Only descend into subtrees that differ */
+                    free(path);
+                    if ((path = concat(prefix, a->name, "/", NULL)) == NULL
+                        || tree_diff(db, a->h, b->h, path, cb, arg)) {
+                        ret = 1;
+                        goto clean_up;
+                    }
+                } else if (cb(arg, 'M', path, a->h, b->h)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+            }
+            ++i;
+            ++j;
+        } else if (c < 0) {
+            if (a->is_dir) {
+                free(path);
+                if ((path = concat(prefix, a->name, "/", NULL)) == NULL
+                    || tree_diff(db, a->h, NULL, path, cb, arg)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+            } else if (cb(arg, 'D', path, a->h, NULL)) {
+                ret = 1;
+                goto clean_up;
+            }
+            ++i;
+        } else {
+            if (b->is_dir) {
+                free(path);
+                if ((path = concat(prefix, b->name, "/", NULL)) == NULL
+                    || tree_diff(db, NULL, b->h, path, cb, arg)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+            } else if (cb(arg, 'A', path, NULL, b->h)) {
+                ret = 1;
+                goto clean_up;
+            }
+            ++j;
+        }
+    }
+
+  clean_up:
+    free(path);
+    free_tree(e1, n1);
+    free_tree(e2, n2);
+    return ret;
+}
+
+int commit_root(sqlite3 * db, char *time, char *root)
+{
+    /*
+     * Finds the root tree of the commit in effect at a time (the last commit
+     * at or before it), and writes it to root. Returns 1 upon failure.
+     */
+    sqlite3_stmt *stmt;
+    int ret = 0;
+
+    if (sqlite3_prepare_v2(db, "select root_h from sloth_commit "
+                           "where t <= cast(? as integer) "
+                           "order by t desc limit 1", -1, &stmt,
+                           NULL) != SQLITE_OK
+        || sqlite3_bind_text(stmt, 1, time, -1, SQLITE_STATIC) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return 1;
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_ROW
+        || sqlite3_column_bytes(stmt, 0) != HASH_HEX_LEN) {
+        fprintf(stderr, "%s: No commit at or before this time\n", time);
+        ret = 1;
+    } else {
+        strcpy(root, (char *) sqlite3_column_text(stmt, 0));
+    }
+
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+int print_change(void *arg, int op, char *path, char *h1, char *h2)
+{
+    /* Change callback that lists the changed paths, as in git --name-status */
+    (void) arg;
+    (void) h1;
+    (void) h2;
+    return printf("%c\t%s\n", op, path) < 0;
+}
+
+int split_lines(char *d, size_t s, struct diff_line **lines, size_t * n)
+{
+    /*
+     * Splits data into lines, which keep their newline (the last line might
+     * not have one), and hashes each line. The lines point into d.
+     * Must free *lines after use. Returns 1 upon failure.
+     */
+    size_t i, k = 0, start = 0;
+    uint32_t x;
+    struct diff_line *t;
+
+    *lines = NULL;
+    *n = 0;
+    for (i = 0; i < s; ++i)
+        if (*(d + i) == '\n')
+            ++k;
+    if (s && *(d + s - 1) != '\n')
+        ++k;
+
+    if (MOF(k, sizeof(struct diff_line))
+        || (*lines = malloc((k ? k : 1) * sizeof(struct diff_line))) == NULL)
+        return 1;
+
+    /* FNV-1a */
+    x = 2166136261u;
+    for (i = 0; i < s; ++i) {
+        x = (x ^ (unsigned char) *(d + i)) * 16777619u;
+        if (*(d + i) == '\n' || i == s - 1) {
+            t = *lines + (*n)++;
+            t->p = d + start;
+            t->len = i + 1 - start;
+            t->hash = x;
+            start = i + 1;
+            x = 2166136261u;
+        }
+    }
+    return 0;
+}
+
+int line_ids(struct diff_line *a, size_t n, struct diff_line *b, size_t m,
+             size_t * k)
+{
+    /*
+     * Numbers the distinct lines of a and b, so that lines can be compared
+     * as numbers, and stores the number of distinct lines in k.
+     * Returns 1 upon failure.
+     */
+    struct diff_line **slot, *t, *u;
+    size_t cap = 16, i, j;
+
+    *k = 0;
+    while (cap / 2 < n + m) {
+        if (MOF(cap, 2))
+            return 1;
+        cap *= 2;
+    }
+    if (MOF(cap, sizeof(struct diff_line *))
+        || (slot = calloc(cap, sizeof(struct diff_line *))) == NULL)
+        return 1;
+
+    for (i = 0; i < n + m; ++i) {
+        t = i < n ? a + i : b + i - n;
+        j = t->hash & (cap - 1);
+        while ((u = *(slot + j)) != NULL && (u->hash != t->hash
+                                             || u->len != t->len
+                                             || memcmp(u->p, t->p, t->len)))
+            j = (j + 1) & (cap - 1);
+        if (u == NULL) {
+            *(slot + j) = t;
+            t->id = (*k)++;
+        } else {
+            t->id = u->id;
+        }
+    }
+
+    free(slot);
+    return 0;
+}
+
+#define LINE_EQ(c, x, y) (*((c)->a + (x)) == *((c)->b + (y)))
+
+void diff_mid(struct diff_ctx *c, long xoff, long xlim, long yoff, long ylim,
+              long *xmid, long *ymid)
+{
+    /*
+     * Finds the middle snake of the shortest edit script between
+     * a[xoff, xlim) and b[yoff, ylim), searching forwards and backwards at
+     * the same time (Myers, 1986), and returns the point where the searches
+     * meet. Diagonal k holds the points where x - y = k. If the search
+     * becomes too expensive, the furthest point reached is returned instead,
+     * giving up on the minimal script for large, very different inputs.
+     * Both ranges must be non-empty, with no common first or last line.
+     */
+    long *fd = c->fd, *bd = c->bd;
+    long dmin = xoff - ylim, dmax = xlim - yoff;
+    long fmid = xoff - yoff, bmid = xlim - ylim;
+    long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    long cost, k, x, y, lo, hi;
+    long fbest, fx = xoff, bbest, bx = xlim;
+    int odd = (fmid - bmid) & 1;
+
+    *(fd + fmid) = xoff;
+    *(bd + bmid) = xlim;
+
+    for (cost = 1;; ++cost) {
+        /* Extend the forward search by one edit */
+        if (fmin > dmin)
+            *(fd + --fmin - 1) = -1;
+        else
+            ++fmin;
+        if (fmax < dmax)
+            *(fd + ++fmax + 1) = -1;
+        else
+            --fmax;
+        for (k = fmax; k >= fmin; k -= 2) {
+            lo = *(fd + k - 1);
+            hi = *(fd + k + 1);
+            x = lo >= hi ? lo + 1 : hi;
+            y = x - k;
+            while (x < xlim && y < ylim && LINE_EQ(c, x, y)) {
+                ++x;
+                ++y;
+            }
+            *(fd + k) = x;
+            if (odd && bmin <= k && k <= bmax && *(bd + k) <= x) {
+                *xmid = x;
+                *ymid = y;
+                return;
+            }
+        }
+
+        /* Extend the backward search by one edit */
+        if (bmin > dmin)
+            *(bd + --bmin - 1) = LONG_MAX;
+        else
+            ++bmin;
+        if (bmax < dmax)
+            *(bd + ++bmax + 1) = LONG_MAX;
+        else
+            --bmax;
+        for (k = bmax; k >= bmin; k -= 2) {
+            lo = *(bd + k - 1);
+            hi = *(bd + k + 1);
+            x = lo < hi ? lo : hi - 1;
+            y = x - k;
+            while (x > xoff && y > yoff && LINE_EQ(c, x - 1, y - 1)) {
+                --x;
+                --y;
+            }
+            *(bd + k) = x;
+            if (!odd && fmin <= k && k <= fmax && x <= *(fd + k)) {
+                *xmid = x;
+                *ymid = y;
+                return;
+            }
+        }
+
+        if (cost >= DIFF_COST_MAX) {
+            /*
+             * Split at whichever search has got further, clamping its
+             * points to the ranges. A split at a corner would not make
+             * progress, so the middle is used instead.
+             */
+            fbest = xoff + yoff;
+            for (k = fmax; k >= fmin; k -= 2) {
+                x = *(fd + k) < xlim ? *(fd + k) : xlim;
+                y = x - k;
+                if (y > ylim) {
+                    x = ylim + k;
+                    y = ylim;
+                }
+                if (x + y > fbest) {
+                    fbest = x + y;
+                    fx = x;
+                }
+            }
+            bbest = xlim + ylim;
+            for (k = bmax; k >= bmin; k -= 2) {
+                x = *(bd + k) > xoff ? *(bd + k) : xoff;
+                y = x - k;
+                if (y < yoff) {
+                    x = yoff + k;
+                    y = yoff;
+                }
+                if (x + y < bbest) {
+                    bbest = x + y;
+                    bx = x;
+                }
+            }
+            if (fbest - (xoff + yoff) >= xlim + ylim - bbest) {
+                *xmid = fx;
+                *ymid = fbest - fx;
+            } else {
+                *xmid = bx;
+                *ymid = bbest - bx;
+            }
+            if ((*xmid == xoff && *ymid == yoff)
+                || (*xmid == xlim && *ymid == ylim)) {
+                *xmid = xoff + (xlim - xoff) / 2;
+                *ymid = yoff + (ylim - yoff) / 2;
+            }
+            return;
+        }
+    }
+}
+
+void diff_seq(struct diff_ctx *c, long xoff, long xlim, long yoff, long ylim)
+{
+    /*
+     * Marks the lines of a[xoff, xlim) to delete and the lines of
+     * b[yoff, ylim) to insert, by splitting at the middle snake and
+     * recursing on both halves. Common first and last lines are skipped.
+     */
+    long xmid, ymid;
+
+    while (xoff < xlim && yoff < ylim && LINE_EQ(c, xoff, yoff)) {
+        ++xoff;
+        ++yoff;
+    }
+    while (xlim > xoff && ylim > yoff && LINE_EQ(c, xlim - 1, ylim - 1)) {
+        --xlim;
+        --ylim;
+    }
+
+    if (xoff == xlim) {
+        while (yoff < ylim)
+            *(c->ins + *(c->rb + yoff++)) = 1;
+    } else if (yoff == ylim) {
+        while (xoff < xlim)
+            *(c->del + *(c->ra + xoff++)) = 1;
+    } else {
+        diff_mid(c, xoff, xlim, yoff, ylim, &xmid, &ymid);
+        diff_seq(c, xoff, xmid, yoff, ymid);
+        diff_seq(c, xmid, xlim, ymid, ylim);
+    }
+}
+
+int print_line(char op, struct diff_line *t)
+{
+    /* Prints a line of a hunk, marking a missing newline as diff does */
+    if (putchar(op) == EOF || fwrite(t->p, 1, t->len, stdout) != t->len)
+        return 1;
+    if (*(t->p + t->len - 1) != '\n'
+        && printf("\n\\ No newline at end of file\n") < 0)
+        return 1;
+    return 0;
+}
+
+void print_range(long start, long len)
+{
+    /* Prints a hunk range, 1-based, as in diff -u */
+    if (len == 1)
+        printf("%ld", start + 1);
+    else
+        printf("%ld,%ld", len ? start + 1 : start, len);
+}
+
+int diff_text(char *name1, char *d1, size_t s1, char *name2, char *d2,
+              size_t s2)
+{
+    /*
+     * Prints the differences between two texts in the unified format, with
+     * DIFF_CONTEXT lines of context. Prints nothing if they are the same.
+     * Returns 1 upon failure.
+     */
+    int ret = 0;
+    struct diff_ctx c;
+    struct diff_line *la = NULL, *lb = NULL;
+    char *seen = NULL;
+    long *v = NULL;
+    size_t n = 0, m = 0, k, nx = 0, ny = 0;
+    long i, j, i0, j0, ae, be, gap, span;
+    int first = 1;
+
+    c.a = NULL;
+    c.ra = NULL;
+    c.del = NULL;
+
+    if (split_lines(d1, s1, &la, &n) || split_lines(d2, s2, &lb, &m)
+        || AOF(n, m) || line_ids(la, n, lb, m, &k)
+        || (seen = calloc(k ? k : 1, 1)) == NULL
+        || AOF(n + m, 3) || MOF(n + m + 3, 2 * sizeof(long))
+        || (v = malloc((n + m + 3) * 2 * sizeof(long))) == NULL
+        || (c.a = malloc((n + m + 1) * sizeof(long))) == NULL
+        || (c.ra = malloc((n + m + 1) * sizeof(long))) == NULL
+        || (c.del = calloc(n + m + 1, 1)) == NULL) {
+        ret = 1;
+        goto clean_up;
+    }
+    c.ins = c.del + n;
+
+    /* Lines that only occur on one side are changes, without a search */
+    for (i = 0; i < (long) n; ++i)
+        *(seen + (la + i)->id) |= 1;
+    for (j = 0; j < (long) m; ++j)
+        *(seen + (lb + j)->id) |= 2;
+    for (i = 0; i < (long) n; ++i) {
+        if (*(seen + (la + i)->id) & 2) {
+            *(c.a + nx) = (la + i)->id;
+            *(c.ra + nx++) = i;
+        } else {
+            *(c.del + i) = 1;
+        }
+    }
+    c.b = c.a + nx;
+    c.rb = c.ra + nx;
+    for (j = 0; j < (long) m; ++j) {
+        if (*(seen + (lb + j)->id) & 1) {
+            *(c.b + ny) = (lb + j)->id;
+            *(c.rb + ny++) = j;
+        } else {
+            *(c.ins + j) = 1;
+        }
+    }
+
+    /* Diagonals run from -(ny + 1) to nx + 1 */
+    c.fd = v + ny + 1;
+    c.bd = v + nx + ny + 3 + ny + 1;
+
+    diff_seq(&c, 0, nx, 0, ny);
+
+    /* Group the changes into hunks, each change with its context */
+    i = 0;
+    j = 0;
+    while (1) {
+        while (i < (long) n && j < (long) m && !*(c.del + i) && !*(c.ins + j)) {
+            ++i;
+            ++j;
+        }
+        if (i == (long) n && j == (long) m)
+            break;
+
+        /* The first change of a hunk */
+        if (first && printf("--- %s\n+++ %s\n", name1, name2) < 0) {
+            ret = 1;
+            goto clean_up;
+        }
+        first = 0;
+        span = i < DIFF_CONTEXT ? i : DIFF_CONTEXT;
+        i0 = i - span;
+        j0 = j - span;
+
+        /* Take in changes until the common run between them is too long */
+        while (1) {
+            while (i < (long) n && *(c.del + i))
+                ++i;
+            while (j < (long) m && *(c.ins + j))
+                ++j;
+            for (gap = 0; i + gap < (long) n && j + gap < (long) m
+                 && !*(c.del + i + gap) && !*(c.ins + j + gap); ++gap);
+            if ((i + gap == (long) n && j + gap == (long) m)
+                || gap > 2 * DIFF_CONTEXT) {
+                span = gap < DIFF_CONTEXT ? gap : DIFF_CONTEXT;
+                ae = i + span;
+                be = j + span;
+                break;
+            }
+            i += gap;
+            j += gap;
+        }
+
+        printf("@@ -");
+        print_range(i0, ae - i0);
+        printf(" +");
+        print_range(j0, be - j0);
+        if (printf(" @@\n") < 0) {
+            ret = 1;
+            goto clean_up;
+        }
+        i = i0;
+        j = j0;
+        while (i < ae || j < be) {
+            if (i < ae && *(c.del + i)) {
+                if (print_line('-', la + i++)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+            } else if (j < be && *(c.ins + j)) {
+                if (print_line('+', lb + j++)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+            } else {
+                if (print_line(' ', la + i++)) {
+                    ret = 1;
+                    goto clean_up;
+                }
+                ++j;
+            }
+        }
+    }
+
+  clean_up:
+    free(la);
+    free(lb);
+    free(seen);
+    free(v);
+    free(c.a);
+    free(c.ra);
+    free(c.del);
+    return ret;
+}
+
+int diff_files(sqlite3 * db)
+{
+    /*
+     * Prints the differences between the last commit and the working tree
+     * for the files in sloth_diff (fn, h1, h2), where a NULL hash means
+     * that the file is absent on that side. Only these files are read: the
+     * old versions from the repository, and the new ones from the working
+     * tree, cleaned as a commit would clean them. Returns 1 upon failure.
+     */
+    int ret = 0;
+    sqlite3_stmt *stmt = NULL;
+    char *fn, *d = NULL, *name1 = NULL, *name2 = NULL;
+    size_t s = 0;
+    int r, binary;
+
+    if (sqlite3_prepare_v2(db, "select fn, h1, h2, blob_data(h1) "
+                           "from sloth_diff order by fn", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        fn = (char *) sqlite3_column_text(stmt, 0);
+        if ((name1 = sqlite3_column_type(stmt, 1) == SQLITE_NULL
+             ? concat("/dev/null", NULL) : concat("a/", fn, NULL)) == NULL
+            || (name2 = sqlite3_column_type(stmt, 2) == SQLITE_NULL
+                ? concat("/dev/null", NULL) : concat("b/", fn, NULL))
+            == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+
+        binary = 0;
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+            if ((d = read_file(fn, &s)) == NULL) {
+                fprintf(stderr, "%s: Cannot read file\n", fn);
+                ret = 1;
+                goto clean_up;
+            }
+            binary = memchr(d, '\0', s) != NULL;
+            clean_data(d, &s);
+        }
+
+        if (binary) {
+            if (printf("Binary files %s and %s differ\n", name1, name2) < 0) {
+                ret = 1;
+                goto clean_up;
+            }
+        } else if (diff_text(name1, (char *) sqlite3_column_blob(stmt, 3),
+                             sqlite3_column_bytes(stmt, 3), name2, d,
+                             d != NULL ? s : 0)) {
+            ret = 1;
+            goto clean_up;
+        }
+
+        free(d);
+        d = NULL;
+        free(name1);
+        name1 = NULL;
+        free(name2);
+        name2 = NULL;
+    }
+    if (r != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+    }
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    free(d);
+    free(name1);
+    free(name2);
+    return ret;
+}
+
+int print_diff(void *arg, int op, char *path, char *h1, char *h2)
+{
+    /*
+     * Change callback that prints the differences in a file in the unified
+     * format. arg is a prepared statement that selects the data of the two
+     * blobs, given their hashes.
+     */
+    sqlite3_stmt *stmt = arg;
+    char *name1, *name2 = NULL;
+    int ret = 0;
+
+    if ((name1 = op == 'A' ? concat("/dev/null", NULL)
+         : concat("a/", path, NULL)) == NULL
+        || (name2 = op == 'D' ? concat("/dev/null", NULL)
+            : concat("b/", path, NULL)) == NULL) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    if ((h1 != NULL ? sqlite3_bind_text(stmt, 1, h1, -1, SQLITE_STATIC)
+         : sqlite3_bind_null(stmt, 1)) != SQLITE_OK
+        || (h2 != NULL ? sqlite3_bind_text(stmt, 2, h2, -1, SQLITE_STATIC)
+            : sqlite3_bind_null(stmt, 2)) != SQLITE_OK
+        || sqlite3_step(stmt) != SQLITE_ROW) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (diff_text(name1, (char *) sqlite3_column_blob(stmt, 0),
+                  sqlite3_column_bytes(stmt, 0), name2,
+                  (char *) sqlite3_column_blob(stmt, 1),
+                  sqlite3_column_bytes(stmt, 1)))
+        ret = 1;
+
+  clean_up:
+    sqlite3_reset(stmt);
+    free(name1);
+    free(name2);
+    return ret;
+}
+
+char *skip_sql_space(char *p)
+{
+    /* Skips whitespace and comments in SQL text */
+    while (1) {
+        if (isspace((unsigned char) *p)) {
+            ++p;
+        } else if (*p == '-' && *(p + 1) == '-') {
+            while (*p != '\0' && *p != '\n')
+                ++p;
+        } else if (*p == '/' && *(p + 1) == '*') {
+            p += 2;
+            while (*p != '\0' && !(*p == '*' && *(p + 1) == '/'))
+                ++p;
+            if (*p != '\0')
+                p += 2;
+        } else {
+            return p;
+        }
+    }
+}
+
+char *next_word(char **p)
+{
+    /*
+     * Returns the next whitespace separated word, terminating it in place,
+     * and advances *p past it. Returns NULL if there are no more words.
+     * Unlike strtok, this does not disturb a strtok in progress in the caller.
+     */
+    char *w;
+    while (isspace((unsigned char) **p))
+        ++*p;
+    if (**p == '\0')
+        return NULL;
+    w = *p;
+    while (**p != '\0' && !isspace((unsigned char) **p))
+        ++*p;
+    if (**p != '\0') {
+        **p = '\0';
+        ++*p;
+    }
+    return w;
+}
+
+int export_blob(struct export_ctx *ec, const char *h, sqlite3_int64 mk)
+{
+    /*
+     * Writes a blob command to the output. A chunked blob is written one chunk
+     * at a time, so it is never held in memory whole. Returns 1 upon failure.
+     */
+    sqlite3_stmt *stmt;
+    size_t s;
+    int r, ret = 0;
+
+    /* Blobs that are not chunked have no chunks */
+    if (sqlite3_bind_text(ec->size, 1, h, -1, SQLITE_STATIC) != SQLITE_OK
+        || sqlite3_step(ec->size) != SQLITE_ROW) {
+        sqlite3_reset(ec->size);
+        fprintf(stderr, "%s\n", sqlite3_errmsg(ec->db));
+        return 1;
+    }
+    s = (size_t) sqlite3_column_int64(ec->size, 0);
+    sqlite3_reset(ec->size);
+
+    stmt = s ? ec->chunks : ec->data;
+    if (sqlite3_bind_text(stmt, 1, h, -1, SQLITE_STATIC) != SQLITE_OK) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (!s) {
+        if (sqlite3_step(stmt) != SQLITE_ROW
+            || sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        s = sqlite3_column_bytes(stmt, 0);
+    }
+
+    if (fprintf(ec->out, "blob\nmark :%ld\ndata %lu\n", (long) mk,
+                (unsigned long) s) < 0) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (stmt == ec->data) {
+        if (fwrite(sqlite3_column_blob(stmt, 0), 1, s, ec->out) != s)
+            ret = 1;
+    } else {
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (sqlite3_column_type(stmt, 0) == SQLITE_NULL
+                || fwrite(sqlite3_column_blob(stmt, 0), 1,
+                          sqlite3_column_bytes(stmt, 0),
+                          ec->out) != (size_t) sqlite3_column_bytes(stmt, 0)) {
+                ret = 1;
+                goto clean_up;
+            }
+        }
+        if (r != SQLITE_DONE)
+            ret = 1;
+    }
+
+    if (fputc('\n', ec->out) == EOF)
+        ret = 1;
+
+  clean_up:
+    if (ret)
+        fprintf(stderr, "%s: Cannot export blob\n", h);
+    sqlite3_reset(stmt);
+    return ret;
+}
+
+int export_change(void *arg, int op, char *path, char *h1, char *h2)
+{
+    /*
+     * Change callback that collects the changes of a commit that is being
+     * exported. The blobs that have not been exported yet are written
+     * straight away, with a new mark, as they must come before the commit.
+     */
+    struct export_ctx *ec = arg;
+    struct export_item *t;
+    size_t new_cap;
+    int r;
+
+    (void) h1;
+
+    if (ec->n == ec->cap) {
+        if (MOF(ec->cap, 2))
+            return 1;
+        new_cap = ec->cap ? ec->cap * 2 : 64;
+        if (MOF(new_cap, sizeof(struct export_item))
+            || (t = realloc(ec->item, new_cap * sizeof(struct export_item)))
+            == NULL)
+            return 1;
+        ec->item = t;
+        ec->cap = new_cap;
+    }
+    t = ec->item + ec->n;
+    t->op = op == 'D' ? 'D' : 'M';
+    t->mk = 0;
+    if ((t->path = strdup(path)) == NULL)
+        return 1;
+    ++ec->n;
+
+    if (t->op == 'D')
+        return 0;
+
+    /* Blobs are exported once, ever */
+    if (sqlite3_bind_text(ec->get_mark, 1, h2, -1, SQLITE_STATIC)
+        != SQLITE_OK || (r = sqlite3_step(ec->get_mark)) == SQLITE_ERROR) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(ec->db));
+        return 1;
+    }
+    if (r == SQLITE_ROW)
+        t->mk = sqlite3_column_int64(ec->get_mark, 0);
+    sqlite3_reset(ec->get_mark);
+    if (t->mk)
+        return 0;
+
+    t->mk = ec->next_mk++;
+    if (sqlite3_bind_text(ec->put_mark, 1, h2, -1, SQLITE_STATIC)
+        != SQLITE_OK || sqlite3_bind_int64(ec->put_mark, 2, t->mk)
+        != SQLITE_OK || sqlite3_step(ec->put_mark) != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(ec->db));
+        return 1;
+    }
+    sqlite3_reset(ec->put_mark);
+
+    return export_blob(ec, h2, t->mk);
+}
+
+int export_git(sqlite3 * db, FILE * out)
+{
+    /*
+     * Writes the commits that have not been exported yet to out, as
+     * a git fast-import stream. Marks are kept in sloth_blob_mark and
+     * sloth_commit_mark, so each export carries on from the last one. Each
+     * commit only lists its changes against its parent, found by comparing
+     * their manifests, and only the blobs that were never exported are
+     * written. Must be called inside of a transaction.
+     * Returns 1 upon failure.
+     */
+    int ret = 0;
+    struct export_ctx ec;
+    sqlite3_stmt *user = NULL, *last = NULL, *com = NULL, *put = NULL;
+    char prev[HASH_HEX_LEN + 1], *root, *name = NULL, *email = NULL;
+    sqlite3_int64 parent_mk = 0, mk, last_t = 0;
+    size_t i;
+    int r;
+
+    ec.db = db;
+    ec.out = out;
+    ec.get_mark = NULL;
+    ec.put_mark = NULL;
+    ec.size = NULL;
+    ec.data = NULL;
+    ec.chunks = NULL;
+    ec.item = NULL;
+    ec.n = 0;
+    ec.cap = 0;
+    *prev = '\0';
+
+    if (sqlite3_prepare_v2(db, "select full_name, email from sloth_user",
+                           -1, &user, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "select coalesce(max(mk), 0) + 1 "
+                              "from (select mk from sloth_blob_mark "
+                              "union all select mk from sloth_commit_mark)",
+                              -1, &last, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "select mk from sloth_blob_mark "
+                              "where h = ?", -1, &ec.get_mark,
+                              NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "insert into sloth_blob_mark (h, mk) "
+                              "values (?, ?)", -1, &ec.put_mark,
+                              NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "select coalesce(sum(s), 0) "
+                              "from sloth_chunk where h = ?", -1, &ec.size,
+                              NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "select blob_data(?)", -1, &ec.data,
+                              NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "select blob_data(chunk_h) "
+                              "from sloth_chunk where h = ? order by i",
+                              -1, &ec.chunks, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "insert into sloth_commit_mark (t, mk) "
+                              "values (?, ?)", -1, &put, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (sqlite3_step(user) != SQLITE_ROW
+        || (name = strdup((char *) sqlite3_column_text(user, 0))) == NULL
+        || (email = strdup((char *) sqlite3_column_text(user, 1))) == NULL) {
+        fprintf(stderr, "No user, see the .user file\n");
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (sqlite3_step(last) != SQLITE_ROW) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    ec.next_mk = sqlite3_column_int64(last, 0);
+    sqlite3_finalize(last);
+
+    /* The last exported commit is the parent of the first new one */
+    if (sqlite3_prepare_v2(db, "select a.t, a.mk, b.root_h "
+                           "from sloth_commit_mark as a "
+                           "inner join sloth_commit as b on b.t = a.t "
+                           "order by a.t desc limit 1", -1, &last,
+                           NULL) != SQLITE_OK
+        || (r = sqlite3_step(last)) == SQLITE_ERROR) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+    if (r == SQLITE_ROW) {
+        last_t = sqlite3_column_int64(last, 0);
+        parent_mk = sqlite3_column_int64(last, 1);
+        if (sqlite3_column_bytes(last, 2) != HASH_HEX_LEN) {
+            ret = 1;
+            goto clean_up;
+        }
+        strcpy(prev, (char *) sqlite3_column_text(last, 2));
+    }
+
+    if (sqlite3_prepare_v2(db, "select t, msg, root_h from sloth_commit "
+                           "where ? = 0 or t > ? order by t", -1, &com,
+                           NULL) != SQLITE_OK
+        || sqlite3_bind_int64(com, 1, parent_mk) != SQLITE_OK
+        || sqlite3_bind_int64(com, 2, last_t) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+
+    while ((r = sqlite3_step(com)) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(com, 2) != HASH_HEX_LEN) {
+            fprintf(stderr, "%ld: Commit without a manifest\n",
+                    (long) sqlite3_column_int64(com, 0));
+            ret = 1;
+            goto clean_up;
+        }
+        root = (char *) sqlite3_column_text(com, 2);
+
+        /* Writes the new blobs, then the commit lists its changes */
+        if (tree_diff(db, *prev != '\0' ? prev : NULL, root, "",
+                      export_change, &ec)) {
+            ret = 1;
+            goto clean_up;
+        }
+
+        mk = ec.next_mk++;
+        if (sqlite3_bind_int64(put, 1, sqlite3_column_int64(com, 0))
+            != SQLITE_OK || sqlite3_bind_int64(put, 2, mk) != SQLITE_OK
+            || sqlite3_step(put) != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(put);
+
+        fprintf(out, "commit refs/heads/master\nmark :%ld\n", (long) mk);
+        fprintf(out, "author %s <%s> %ld +0000\n", name, email,
+               (long) sqlite3_column_int64(com, 0));
+        fprintf(out, "committer %s <%s> %ld +0000\n", name, email,
+               (long) sqlite3_column_int64(com, 0));
+        fprintf(out, "data %lu\n%s\n",
+               (unsigned long) sqlite3_column_bytes(com, 1) + 1,
+               (char *) sqlite3_column_text(com, 1));
+        if (parent_mk)
+            fprintf(out, "from :%ld\n", (long) parent_mk);
+        for (i = 0; i < ec.n; ++i) {
+            if ((ec.item + i)->op == 'D')
+                fprintf(out, "D %s\n", (ec.item + i)->path);
+            else
+                fprintf(out, "M 100644 :%ld %s\n", (long) (ec.item + i)->mk,
+                       (ec.item + i)->path);
+            free((ec.item + i)->path);
+        }
+        ec.n = 0;
+        if (fputc('\n', out) == EOF) {
+            ret = 1;
+            goto clean_up;
+        }
+
+        parent_mk = mk;
+        strcpy(prev, root);
+    }
+    if (r != SQLITE_DONE) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (fflush(out))
+        ret = 1;
+
+  clean_up:
+    sqlite3_finalize(user);
+    sqlite3_finalize(last);
+    sqlite3_finalize(com);
+    sqlite3_finalize(put);
+    sqlite3_finalize(ec.get_mark);
+    sqlite3_finalize(ec.put_mark);
+    sqlite3_finalize(ec.size);
+    sqlite3_finalize(ec.data);
+    sqlite3_finalize(ec.chunks);
+    for (i = 0; i < ec.n; ++i)
+        free((ec.item + i)->path);
+    free(ec.item);
+    free(name);
+    free(email);
+    return ret;
+}
+
+int dot_cmd(sqlite3 * db, char *line, FILE ** out, int *quit)
+{
+    /*
+     * Runs a dot-command from a SQL script. Only the dot-commands that the
+     * scripts use are supported:
+     * .import FILE TABLE
+     * .output [FILE]
+     * .quit
+     * The following dot-commands are specific to sloth:
+     * .stage     Reads, cleans and hashes the changed files in sloth_stage
+     * .hash      Like .stage, but only fills in the hashes
+     * .diff      Prints the differences listed in sloth_diff
+     * .tree      Builds the manifest of sloth_stage, see sloth_tmp_root
+     * .roots     Builds the manifests of the commits without a root_h
+     * .export    Writes the commits not exported yet, as a fast-import stream
+     */
+    char *cmd, *arg1, *arg2;
+
+    cmd = next_word(&line);
+    arg1 = next_word(&line);
+    arg2 = next_word(&line);
+
+    if (!strcmp(cmd, ".quit")) {
+        *quit = 1;
+    } else if (!strcmp(cmd, ".output")) {
+        if (*out != stdout) {
+            if (fclose(*out)) {
+                *out = stdout;
+                return 1;
+            }
+            *out = stdout;
+        }
+        if (arg1 != NULL && (*out = fopen(arg1, "wb")) == NULL) {
+            *out = stdout;
+            return 1;
+        }
+    } else if (!strcmp(cmd, ".stage")) {
+        if (stage_files(db, 0))
+            return 1;
+    } else if (!strcmp(cmd, ".hash")) {
+        if (stage_files(db, 1))
+            return 1;
+    } else if (!strcmp(cmd, ".diff")) {
+        if (diff_files(db))
+            return 1;
+    } else if (!strcmp(cmd, ".tree")) {
+        if (tree_stage(db))
+            return 1;
+    } else if (!strcmp(cmd, ".roots")) {
+        if (tree_roots(db))
+            return 1;
+    } else if (!strcmp(cmd, ".export")) {
+        if (export_git(db, *out))
+            return 1;
+    } else if (!strcmp(cmd, ".import") && arg2 != NULL) {
+        if (import_file(db, arg1, arg2))
+            return 1;
+    } else {
+        fprintf(stderr, "Unsupported dot-command: %s\n", cmd);
+        return 1;
+    }
+
+    return 0;
+}
+
+int run_sql(sqlite3 * db, char *script_dir, char *script_name)
+{
+    /*
+     * Runs a SQL script in-process. Each statement is prepared and stepped
+     * in turn, and the rows returned by queries are written to the output
+     * (stdout, unless redirected by .output). Does not begin or commit a
+     * transaction, that is left to the caller.
+     */
+    int ret = 0;
+    char *sql_path;
+    char *sql = NULL;
+    char *p, *q;
+    const char *tail;
+    size_t fs;
+    sqlite3_stmt *stmt = NULL;
+    FILE *out = stdout;
+    int quit = 0;
+    int r;
+
+    if ((sql_path = path_join(script_dir, script_name)) == NULL)
+        return 1;
+
+    if ((sql = read_file(sql_path, &fs)) == NULL) {
+        fprintf(stderr, "%s: Cannot read script\n", sql_path);
+        ret = 1;
+        goto clean_up;
+    }
+
+    p = skip_sql_space(sql);
+    while (*p != '\0' && !quit) {
+        if (*p == '.') {
+            /* Dot-command, which runs to the end of the line */
+            if ((q = strchr(p, '\n')) != NULL)
+                *q = '\0';
+            if (dot_cmd(db, p, &out, &quit)) {
+                fprintf(stderr, "%s: Dot-command failed\n", sql_path);
+                ret = 1;
+                goto clean_up;
+            }
+            p = q != NULL ? q + 1 : p + strlen(p);
+        } else {
+            if (sqlite3_prepare_v2(db, p, -1, &stmt, &tail) != SQLITE_OK) {
+                fprintf(stderr, "%s: %s\n", sql_path, sqlite3_errmsg(db));
+                ret = 1;
+                goto clean_up;
+            }
+            p = (char *) tail;
+            if (stmt != NULL) {
+                while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+                    if (print_row(stmt, out)) {
+                        ret = 1;
+                        goto clean_up;
+                    }
+                }
+                if (r != SQLITE_DONE) {
+                    fprintf(stderr, "%s: %s\n", sql_path,
+                            sqlite3_errmsg(db));
+                    ret = 1;
+                    goto clean_up;
+                }
+                sqlite3_finalize(stmt);
+                stmt = NULL;
+            }
+        }
+        p = skip_sql_space(p);
+    }
+
+  clean_up:
+    sqlite3_finalize(stmt);
+    if (out != stdout && fclose(out))
+        ret = 1;
+    if (fflush(stdout))
+        ret = 1;
+    free(sql_path);
+    free(sql);
+    return ret;
+}
+
+int get_int(sqlite3 * db, char *sql, int *v)
+{
+    /* Runs a query that returns a single integer, such as a pragma */
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return 1;
+    }
+    *v = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+int migrate(sqlite3 * db, char *script_dir)
+{
+    /*
+     * Brings the schema of an existing database up to SCHEMA_VERSION by
+     * running migrate_N.sql for each missing version N. Each step runs in
+     * its own transaction, together with the update of the version.
+     * Migrations rebuild tables, so the database is vacuumed afterwards to
+     * return the freed pages.
+     */
+    int v, start;
+    char script_name[32];
+    char sql[48];
+
+    if (get_int(db, "pragma user_version", &v))
+        return 1;
+    start = v;
+
+    while (v < SCHEMA_VERSION) {
+        ++v;
+        sprintf(script_name, "migrate_%d.sql", v);
+        sprintf(sql, "pragma user_version = %d", v);
+        if (exec_sql(db, "begin", NULL)
+            || run_sql(db, script_dir, script_name)
+            || exec_sql(db, sql, NULL)
+            || exec_sql(db, "commit", NULL))
+            return 1;
+    }
+
+    /* Cannot vacuum inside of a transaction */
+    if (v != start && exec_sql(db, "vacuum", NULL))
+        return 1;
+
+    return 0;
+}
+
+sqlite3 *open_repo(char *script_dir)
+{
+    /*
+     * Opens sloth.db and migrates it to the current schema.
+     * Returns NULL upon failure.
+     */
+    sqlite3 *db;
+
+    if ((db = open_db("sloth.db")) == NULL)
+        return NULL;
+
+    if (migrate(db, script_dir)) {
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+int sloth_commit(sqlite3 * db, char *script_dir, char *msg, char *time)
+{
+    /*
+     * Records a commit. Must be called inside of a transaction, which makes
+     * the commit atomic.
+     */
+    if (exec_sql(db, "delete from sloth_tmp_text", NULL))
+        return 1;
+
+    if (exec_sql(db, "insert into sloth_tmp_text (x) values (?)", msg))
+        return 1;
+
+    if (exec_sql(db, "delete from sloth_tmp_int", NULL))
+        return 1;
+
+    if (time == NULL) {
+        if (exec_sql(db, "insert into sloth_tmp_int (i) "
+                     "select strftime('%s', 'now')", NULL))
+            return 1;
+    } else {
+        if (exec_sql(db, "insert into sloth_tmp_int (i) values (?)", time))
+            return 1;
+    }
+
+    if (run_sql(db, script_dir, "commit.sql"))
+        return 1;
+
+    return 0;
+}
+
+int read_line(FILE * fp, char **line, size_t * cap)
+{
+    /*
+     * Reads a line into *line, which grows as needed, without the newline.
+     * Returns 0 upon success, -1 at the end of the file (when nothing was
+     * read), or 1 upon failure.
+     */
+    size_t len = 0;
+    char *t;
+    int c;
+
+    while ((c = getc(fp)) != EOF && c != '\n') {
+        if (len + 1 >= *cap) {
+            if (MOF(*cap, 2))
+                return 1;
+            if ((t = realloc(*line, *cap ? *cap * 2 : 256)) == NULL)
+                return 1;
+            *line = t;
+            *cap = *cap ? *cap * 2 : 256;
+        }
+        *(*line + len++) = c;
+    }
+    if (ferror(fp))
+        return 1;
+    if (c == EOF && !len)
+        return -1;
+    if (*cap == 0) {
+        if ((*line = malloc(1)) == NULL)
+            return 1;
+        *cap = 1;
+    }
+    *(*line + len) = '\0';
+    return 0;
+}
+
+int unquote_path(char *p)
+{
+    /*
+     * Unquotes a path of a git fast-export stream in place. Paths with
+     * special characters are in double quotes, with C-style escapes, and
+     * octal escapes for the bytes of non-ASCII characters. Returns 1 if
+     * the quoting is not valid.
+     */
+    char *q = p, *r = p + 1;
+    int c, i;
+
+    if (*p != '"')
+        return 0;
+
+    while (*r != '"') {
+        if (*r == '\0')
+            return 1;
+        if (*r != '\\') {
+            *q++ = *r++;
+            continue;
+        }
+        ++r;
+        switch (*r) {
+        case 'a':
+            c = '\a';
+            break;
+        case 'b':
+            c = '\b';
+            break;
+        case 'f':
+            c = '\f';
+            break;
+        case 'n':
+            c = '\n';
+            break;
+        case 'r':
+            c = '\r';
+            break;
+        case 't':
+            c = '\t';
+            break;
+        case 'v':
+            c = '\v';
+            break;
+        case '"':
+        case '\\':
+            c = *r;
+            break;
+        default:
+            /* Three octal digits */
+            for (c = 0, i = 0; i < 3; ++i) {
+                if (*(r + i) < '0' || *(r + i) > '7')
+                    return 1;
+                c = c * 8 + *(r + i) - '0';
+            }
+            r += 2;
+            if (c > UCHAR_MAX)
+                return 1;
+        }
+        *q++ = c;
+        ++r;
+    }
+    if (*(r + 1) != '\0')
+        return 1;
+    *q = '\0';
+    return 0;
+}
+
+int read_blob(FILE * fp, char *line, char **d, size_t * s)
+{
+    /*
+     * Reads the data of a "data <count>" line of a git fast-export stream
+     * into memory. A terminating '\0' char is appended (it is not counted
+     * in s). Returns 1 upon failure.
+     */
+    unsigned long x;
+    char *end;
+
+    *d = NULL;
+    if (strncmp(line, "data ", 5) || *(line + 5) == '\0')
+        return 1;
+    errno = 0;
+    x = strtoul(line + 5, &end, 10);
+    if (errno || *end != '\0' || x == ULONG_MAX || x > SIZE_MAX - 1)
+        return 1;
+    *s = x;
+
+    if ((*d = malloc(*s + 1)) == NULL)
+        return 1;
+    if (fread(*d, 1, *s, fp) != *s) {
+        free(*d);
+        *d = NULL;
+        return 1;
+    }
+    *(*d + *s) = '\0';
+    return 0;
+}
+
+int import_commit(struct import_ctx *ic, char *script_dir, char *msg,
+                  char *time)
+{
+    /*
+     * Records the changes of a commit of the stream, which are in ic. The
+     * new manifest is built from the last one, and only the changed files
+     * are written to sloth_stage, where the new blobs are compressed, so
+     * that import.sql can add the commit. A commit that changes nothing
+     * (once the files are cleaned) is skipped. Returns 1 upon failure.
+     */
+    int ret = 0;
+    char root[HASH_HEX_LEN + 1];
+    struct tree_item *t;
+    size_t i;
+
+    qsort(ic->item, ic->n, sizeof(struct tree_item), path_cmp);
+
+    if (tree_update(ic->db, &ic->tc, *ic->root != '\0' ? ic->root : NULL,
+                    ic->item, ic->n, 0, root)) {
+        fprintf(stderr, "Cannot build tree: %s\n", sqlite3_errmsg(ic->db));
+        ret = 1;
+        goto clean_up;
+    }
+    if (!strcmp(root, ic->root)) {
+        fprintf(stderr, "%s: No changes, skipped\n", time);
+        goto clean_up;
+    }
+
+    if (exec_sql(ic->db, "delete from sloth_stage", NULL)) {
+        ret = 1;
+        goto clean_up;
+    }
+    for (i = 0; i < ic->n; ++i) {
+        t = ic->item + i;
+        if (sqlite3_bind_text(ic->stage, 1, t->fn, -1, SQLITE_STATIC)
+            != SQLITE_OK
+            || (*t->h != '\0'
+                ? sqlite3_bind_text(ic->stage, 2, t->h, HASH_HEX_LEN,
+                                    SQLITE_STATIC)
+                : sqlite3_bind_null(ic->stage, 2)) != SQLITE_OK
+            || sqlite3_step(ic->stage) != SQLITE_DONE) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(ic->db));
+            ret = 1;
+            goto clean_up;
+        }
+        sqlite3_reset(ic->stage);
+    }
+
+    if ((ic->sp.n && pack_jobs(ic->db, &ic->sp))
+        || exec_sql(ic->db, "delete from sloth_tmp_text", NULL)
+        || exec_sql(ic->db, "insert into sloth_tmp_text (x) values (?)", msg)
+        || exec_sql(ic->db, "delete from sloth_tmp_int", NULL)
+        || exec_sql(ic->db, "insert into sloth_tmp_int (i) values (?)", time)
+        || exec_sql(ic->db, "delete from sloth_tmp_root", NULL)
+        || exec_sql(ic->db, "insert into sloth_tmp_root (h) values (?)", root)
+        || run_sql(ic->db, script_dir, "import.sql")) {
+        ret = 1;
+        goto clean_up;
+    }
+    strcpy(ic->root, root);
+
+  clean_up:
+    for (i = 0; i < ic->n; ++i)
+        free((ic->item + i)->fn);
+    ic->n = 0;
+    for (i = 0; i < ic->sp.n; ++i) {
+        free((ic->sp.job + i)->fn);
+        free((ic->sp.job + i)->d);
+        free((ic->sp.job + i)->base);
+    }
+    ic->sp.n = 0;
+    return ret;
+}
+
+int import_change(struct import_ctx *ic, char *line)
+{
+    /*
+     * Adds a file command of a commit of the stream to ic:
+     *     M <mode> :<mark> <path>    or    D <path>
+     * Submodules are left out. The blobs that are not stored yet become
+     * jobs, to be compressed along with the commit. Returns 1 upon failure.
+     */
+    struct tree_item *t;
+    struct stage_job *j;
+    struct import_blob *b = NULL;
+    char *mode, *ref, *path;
+    unsigned long mk;
+    size_t new_cap;
+
+    if (*line == 'D' && *(line + 1) == ' ') {
+        path = line + 2;
+    } else if (*line == 'M' && *(line + 1) == ' ') {
+        mode = line + 2;
+        if ((ref = strchr(mode, ' ')) == NULL
+            || (path = strchr(ref + 1, ' ')) == NULL)
+            return 1;
+        *ref++ = '\0';
+        *path++ = '\0';
+        /* A submodule is a commit of another repository */
+        if (!strcmp(mode, "160000"))
+            return 0;
+        if (*ref != ':')
+            return 1;
+        mk = strtoul(ref + 1, NULL, 10);
+        if (!mk || mk >= ic->num_blob
+            || *(b = ic->blob + mk)->h == '\0')
+            return 1;
+    } else {
+        return 1;
+    }
+
+    if (unquote_path(path) || *path == '\0')
+        return 1;
+
+    if (ic->n == ic->cap) {
+        if (MOF(ic->cap, 2))
+            return 1;
+        new_cap = ic->cap ? ic->cap * 2 : 64;
+        if (MOF(new_cap, sizeof(struct tree_item))
+            || (t = realloc(ic->item, new_cap * sizeof(struct tree_item)))
+            == NULL)
+            return 1;
+        ic->item = t;
+        ic->cap = new_cap;
+    }
+    t = ic->item + ic->n;
+    if ((t->fn = strdup(path)) == NULL)
+        return 1;
+    ++ic->n;
+    strcpy(t->h, b != NULL ? b->h : "");
+
+    if (b == NULL || b->d == NULL)
+        return 0;
+
+    /* The data of the blob moves to the job that stores it */
+    if (ic->sp.n == ic->job_cap) {
+        if (MOF(ic->job_cap, 2))
+            return 1;
+        new_cap = ic->job_cap ? ic->job_cap * 2 : 64;
+        if (MOF(new_cap, sizeof(struct stage_job))
+            || (j = realloc(ic->sp.job, new_cap * sizeof(struct stage_job)))
+            == NULL)
+            return 1;
+        ic->sp.job = j;
+        ic->job_cap = new_cap;
+    }
+    j = ic->sp.job + ic->sp.n;
+    if ((j->fn = strdup(path)) == NULL)
+        return 1;
+    ++ic->sp.n;
+    j->d = b->d;
+    j->s = b->s;
+    strcpy(j->h, b->h);
+    j->base = NULL;
+    *j->base_h = '\0';
+    j->depth = 0;
+    j->chunked = 0;
+    j->is_new = 0;
+    j->enc = ENC_RAW;
+    j->use_dict = 0;
+    j->err = 0;
+    j->missing = 0;
+    b->d = NULL;
+
+    return 0;
+}
+
+int import_blob(struct import_ctx *ic, FILE * fp, char **line, size_t * cap)
+{
+    /*
+     * Reads a blob command of the stream, after its "blob" line. The data
+     * is cleaned and hashed, and kept until a commit uses it, unless the
+     * blob is stored already. Large blobs are streamed into the repository
+     * straight away, chunk by chunk. Returns 1 upon failure.
+     */
+    struct import_blob *b;
+    unsigned long mk, x;
+    size_t new_num, i;
+    char *end;
+    int c, r;
+
+    if (read_line(fp, line, cap) || strncmp(*line, "mark :", 6))
+        return 1;
+    mk = strtoul(*line + 6, NULL, 10);
+    if (!mk || mk == ULONG_MAX)
+        return 1;
+
+    if (mk >= ic->num_blob) {
+        if (MOF(mk, 2))
+            return 1;
+        new_num = mk * 2;
+        if (MOF(new_num, sizeof(struct import_blob))
+            || (b = realloc(ic->blob, new_num * sizeof(struct import_blob)))
+            == NULL)
+            return 1;
+        ic->blob = b;
+        for (i = ic->num_blob; i < new_num; ++i) {
+            *(ic->blob + i)->h = '\0';
+            (ic->blob + i)->d = NULL;
+        }
+        ic->num_blob = new_num;
+    }
+    b = ic->blob + mk;
+
+    do {
+        if (read_line(fp, line, cap))
+            return 1;
+    } while (!strncmp(*line, "original-oid ", 13));
+
+    if (strncmp(*line, "data ", 5))
+        return 1;
+    errno = 0;
+    x = strtoul(*line + 5, &end, 10);
+    if (errno || *end != '\0')
+        return 1;
+
+    if (x >= CHUNK_FILE_MIN) {
+        if (ic->cctx == NULL && (ic->cctx = ZSTD_createCCtx()) == NULL)
+            return 1;
+        if (store_chunked(ic->db, ic->cctx, fp, x, "blob", b->h))
+            return 1;
+    } else {
+        if (read_blob(fp, *line, &b->d, &b->s))
+            return 1;
+        clean_data(b->d, &b->s);
+        sha256_hex((unsigned char *) b->d, b->s, b->h);
+
+        /* Deduplicate by hash */
+        if (sqlite3_bind_text(ic->sel, 1, b->h, HASH_HEX_LEN, SQLITE_STATIC)
+            != SQLITE_OK || (r = sqlite3_step(ic->sel)) == SQLITE_ERROR) {
+            fprintf(stderr, "%s\n", sqlite3_errmsg(ic->db));
+            return 1;
+        }
+        sqlite3_reset(ic->sel);
+        if (r == SQLITE_ROW) {
+            free(b->d);
+            b->d = NULL;
+        }
+    }
+
+    /* The data may be followed by a newline */
+    if ((c = getc(fp)) != '\n' && c != EOF && ungetc(c, fp) == EOF)
+        return 1;
+
+    return 0;
+}
+
+int import_git(char *script_dir)
+{
+    /*
+     * Imports the history of the current git branch, following the first
+     * parent of merges, by reading the output of git fast-export as a
+     * stream. Each blob is read, cleaned and hashed once, and only stored
+     * if it is new. Each commit only applies its changes to the records
+     * and to the manifest of the commit before it, so the time taken
+     * follows the size of the history, not the number of commits times
+     * the size of the tree. The repository must not have any commits.
+     * All of the commits are imported in one transaction.
+     */
+    int ret = 0;
+    FILE *fp = NULL;
+    char *line = NULL, *msg = NULL, *p;
+    size_t cap = 0, s, i;
+    struct import_ctx ic;
+    char time[32];
+    long t = 0;
+    int r, v, author, mutex_on = 0;
+
+    ic.db = NULL;
+    ic.sel = NULL;
+    ic.stage = NULL;
+    ic.cctx = NULL;
+    ic.blob = NULL;
+    ic.num_blob = 0;
+    ic.item = NULL;
+    ic.n = 0;
+    ic.cap = 0;
+    ic.sp.job = NULL;
+    ic.sp.n = 0;
+    ic.sp.hash_only = 0;
+    ic.job_cap = 0;
+    *ic.root = '\0';
+    ic.tc.sel = NULL;
+    ic.tc.ins_tree = NULL;
+    ic.tc.ins_entry = NULL;
+
+    if ((ic.db = open_repo(script_dir)) == NULL) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (exec_sql(ic.db, "begin", NULL)
+        || get_int(ic.db, "select count(*) from sloth_commit", &v)) {
+        ret = 1;
+        goto clean_up;
+    }
+    if (v) {
+        fprintf(stderr, "Can only import into a repository without "
+                "commits, see sloth combine\n");
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (sqlite3_prepare_v2(ic.db, "select 1 from sloth_blob where h = ?",
+                           -1, &ic.sel, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(ic.db, "insert into sloth_stage (fn, h) "
+                              "values (?, ?)", -1, &ic.stage,
+                              NULL) != SQLITE_OK
+        || init_tree_ctx(ic.db, &ic.tc)) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(ic.db));
+        ret = 1;
+        goto clean_up;
+    }
+
+#ifdef _WIN32
+    InitializeCriticalSection(&ic.sp.mutex);
+#else
+    if (pthread_mutex_init(&ic.sp.mutex, NULL)) {
+        ret = 1;
+        goto clean_up;
+    }
+#endif
+    mutex_on = 1;
+
+    if ((fp = popen("git fast-export --first-parent --reencode=yes HEAD",
+                    POPEN_READ)) == NULL) {
+        fprintf(stderr, "Cannot run git fast-export\n");
+        ret = 1;
+        goto clean_up;
+    }
+
+    while ((r = read_line(fp, &line, &cap)) == 0) {
+        if (!strcmp(line, "blob")) {
+            if (import_blob(&ic, fp, &line, &cap)) {
+                fprintf(stderr, "Cannot import blob\n");
+                ret = 1;
+                goto clean_up;
+            }
+        } else if (!strncmp(line, "commit ", 7)) {
+            /* Header lines, up to the message */
+            author = 0;
+            while (!(r = read_line(fp, &line, &cap))
+                   && strncmp(line, "data ", 5)) {
+                /* The author time is kept over the committer time */
+                if (!strncmp(line, "author ", 7)
+                    || (!author && !strncmp(line, "committer ", 10))) {
+                    if ((p = strrchr(line, '>')) == NULL) {
+                        r = 1;
+                        break;
+                    }
+                    t = strtol(p + 1, NULL, 10);
+                    author = *line == 'a';
+                }
+            }
+            if (r || read_blob(fp, line, &msg, &s)) {
+                fprintf(stderr, "Cannot read commit\n");
+                ret = 1;
+                goto clean_up;
+            }
+            sprintf(time, "%ld", t);
+            /* Only the first line of the message is kept */
+            if ((p = strchr(msg, '\n')) != NULL)
+                *p = '\0';
+
+            /* File commands, up to a blank line */
+            while (!(r = read_line(fp, &line, &cap)) && *line != '\0') {
+                if (!strncmp(line, "from ", 5)
+                    || !strncmp(line, "merge ", 6))
+                    continue;
+                if (import_change(&ic, line)) {
+                    fprintf(stderr, "Unsupported change: %s\n", line);
+                    r = 1;
+                    break;
+                }
+            }
+            if (r == 1 || import_commit(&ic, script_dir, msg, time)) {
+                ret = 1;
+                goto clean_up;
+            }
+            free(msg);
+            msg = NULL;
+        } else if (*line != '\0' && strncmp(line, "reset ", 6)
+                   && strncmp(line, "from ", 5)) {
+            fprintf(stderr, "Unsupported command: %s\n", line);
+            ret = 1;
+            goto clean_up;
+        }
+    }
+    if (r == 1) {
+        ret = 1;
+        goto clean_up;
+    }
+
+    if (close_cmd(fp)) {
+        fp = NULL;
+        fprintf(stderr, "git fast-export failed\n");
+        ret = 1;
+        goto clean_up;
+    }
+    fp = NULL;
+
+    /* Track the files of the last commit */
+    if (exec_sql(ic.db, "delete from sloth_tmp_int", NULL)
+        || exec_sql(ic.db, "insert into sloth_tmp_int (i) "
+                    "select max(t) from sloth_commit", NULL)
+        || run_sql(ic.db, script_dir, "import_index.sql")
+        || exec_sql(ic.db, "commit", NULL))
+        ret = 1;
+
+  clean_up:
+    if (fp != NULL)
+        close_cmd(fp);
+    free(line);
+    free(msg);
+    sqlite3_finalize(ic.sel);
+    sqlite3_finalize(ic.stage);
+    free_tree_ctx(&ic.tc);
+    ZSTD_freeCCtx(ic.cctx);
+    if (mutex_on) {
+#ifdef _WIN32
+        DeleteCriticalSection(&ic.sp.mutex);
+#else
+        pthread_mutex_destroy(&ic.sp.mutex);
+#endif
+    }
+    for (i = 0; i < ic.num_blob; ++i)
+        free((ic.blob + i)->d);
+    free(ic.blob);
+    for (i = 0; i < ic.n; ++i)
+        free((ic.item + i)->fn);
+    free(ic.item);
+    for (i = 0; i < ic.sp.n; ++i) {
+        free((ic.sp.job + i)->fn);
+        free((ic.sp.job + i)->d);
+        free((ic.sp.job + i)->base);
+    }
+    free(ic.sp.job);
+    /* Closing the database rolls back the transaction upon failure */
+    if (sqlite3_close(ic.db) != SQLITE_OK)
+        ret = 1;
+
+    return ret;
+}
+
+void print_usage(char *prgm_name)
+{
+    fprintf(stderr, "Usage: %1$s init|log|diff|import|export|repack\n"
+            "%1$s log path\n"
+            "%1$s export [full]\n"
+            "%1$s diff time1 time2\n"
+            "%1$s changes time1 time2\n"
+            "%1$s checkout [time]\n"
+            "%1$s subdir prefix_directory_name\n"
+            "%1$s combine path_to_other_sloth.db\n"
+            "%1$s commit msg [time]\n", prgm_name);
+}
+
+int main(int argc, char **argv)
 {
     int ret = 0;
     char *prgm_name;
     char *script_dir;
     char *opt = NULL;
-    char *subdir = NULL;
-    char *other_sloth_path = NULL;
-    char *tmp_dir = NULL;
-    char *cmd = NULL;
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    int lock_fd = -1;
+    int v;
+    int changed = 0;
+    char root1[HASH_HEX_LEN + 1], root2[HASH_HEX_LEN + 1];
 
     if (argc < 2) {
         print_usage(*argv);
@@ -645,152 +5333,249 @@ int main(int argc, char **argv)
         goto clean_up;
     }
 
+    if (lock_repo(&lock_fd)) {
+        ret = 1;
+        goto clean_up;
+    }
+
     if (!strcmp(opt, "init")) {
-        if (run_sql("sloth.db", script_dir, "ddl.sql")) {
+        if ((db = open_db("sloth.db")) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        if (exec_sql(db, "begin", NULL)
+            || run_sql(db, script_dir, "ddl.sql")
+            || exec_sql(db, "commit", NULL)) {
             ret = 1;
             goto clean_up;
         }
     } else if (!strcmp(opt, "log")) {
-        if (run_sql("sloth.db", script_dir, "log.sql")) {
+        if (argc != 2 && argc != 3) {
+            print_usage(prgm_name);
             ret = 1;
             goto clean_up;
         }
-    } else if (!strcmp(opt, "commit")) {
-        if (argc == 3) {
-            if (sloth_commit(script_dir, *(argv + 2), NULL, 1)) {
-                ret = 1;
-                goto clean_up;
-            }
-        } else if (argc == 4) {
-            if (sloth_commit(script_dir, *(argv + 2), *(argv + 3), 1)) {
+
+        if ((db = open_repo(script_dir)) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+
+        if (argc == 2) {
+            if (run_sql(db, script_dir, "log.sql")) {
                 ret = 1;
                 goto clean_up;
             }
-        } else {
+        } else if (exec_sql(db, "begin", NULL)
+                   || exec_sql(db, "delete from sloth_tmp_text", NULL)
+                   || exec_sql(db, "insert into sloth_tmp_text (x) "
+                               "values (?)", *(argv + 2))
+                   || run_sql(db, script_dir, "log_path.sql")
+                   || exec_sql(db, "rollback", NULL)) {
+            ret = 1;
+            goto clean_up;
+        }
+    } else if (!strcmp(opt, "commit")) {
+        if (argc != 3 && argc != 4) {
             print_usage(prgm_name);
             ret = 1;
             goto clean_up;
         }
+
+        if ((db = open_repo(script_dir)) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+
+        if (exec_sql(db, "begin", NULL)
+            || sloth_commit(db, script_dir, *(argv + 2),
+                            argc == 4 ? *(argv + 3) : NULL)
+            || exec_sql(db, "commit", NULL)) {
+            ret = 1;
+            goto clean_up;
+        }
     } else if (!strcmp(opt, "export")) {
-        if (run_sql("sloth.db", script_dir, "export.sql")) {
+        if (argc == 3 ? strcmp(*(argv + 2), "full") : argc != 2) {
+            print_usage(prgm_name);
             ret = 1;
             goto clean_up;
         }
-    } else if (!strcmp(opt, "import")) {
-        if (import_git(script_dir)) {
+
+        if ((db = open_repo(script_dir)) == NULL) {
             ret = 1;
             goto clean_up;
         }
-    } else if (!strcmp(opt, "subdir")) {
-        if (argc != 3) {
+
+        /* Forgetting the marks starts the export over */
+        if (exec_sql(db, "begin", NULL)
+            || (argc == 3
+                && (exec_sql(db, "delete from sloth_blob_mark", NULL)
+                    || exec_sql(db, "delete from sloth_commit_mark", NULL)))
+            || run_sql(db, script_dir, "export.sql")
+            || exec_sql(db, "commit", NULL)) {
+            ret = 1;
+            goto clean_up;
+        }
+    } else if (!strcmp(opt, "checkout")) {
+        if (argc != 2 && argc != 3) {
             print_usage(prgm_name);
             ret = 1;
             goto clean_up;
         }
 
-        /* Backup */
-        if (cp_file("sloth.db", "sloth_copy.db")) {
+        if ((db = open_repo(script_dir)) == NULL) {
             ret = 1;
             goto clean_up;
         }
 
-        if ((subdir = strdup(*(argv + 2))) == NULL) {
+        /*
+         * Plan, then write the files outside of a transaction (the threads
+         * read the repository), then track the snapshot. The index is
+         * refreshed even if the checkout failed partway, so that it matches
+         * the files that were written.
+         */
+        if (exec_sql(db, "begin", NULL)
+            || exec_sql(db, "delete from sloth_tmp_int", NULL)
+            || (argc == 3
+                ? exec_sql(db, "insert into sloth_tmp_int (i) values (?)",
+                           *(argv + 2))
+                : exec_sql(db, "insert into sloth_tmp_int (i) "
+                           "select max(t) from sloth_commit", NULL))
+            || run_sql(db, script_dir, "checkout.sql")
+            || exec_sql(db, "commit", NULL)) {
             ret = 1;
             goto clean_up;
         }
-        swap_ch(subdir, '\'', ' ');
 
-        if ((cmd =
-             concat("sqlite3 sloth_copy.db \"delete from sloth_tmp_text; ",
-                    "insert into sloth_tmp_text (x) values (\'", subdir,
-                    "\');\"", NULL)) == NULL)
-            return 1;
+        if (checkout_files(db, &changed))
+            ret = 1;
 
-        if (sys_cmd(cmd)) {
+        if (changed && (exec_sql(db, "begin", NULL)
+                        || run_sql(db, script_dir, "checkout_index.sql")
+                        || exec_sql(db, "commit", NULL)))
+            ret = 1;
+    } else if (!strcmp(opt, "changes")) {
+        if (argc != 4) {
+            print_usage(prgm_name);
             ret = 1;
             goto clean_up;
         }
 
-        if (run_sql("sloth_copy.db", script_dir, "subdir.sql")) {
+        if ((db = open_repo(script_dir)) == NULL) {
             ret = 1;
             goto clean_up;
         }
 
-        /* Atomic on POSIX */
-        if (mv_file("sloth_copy.db", "sloth.db")) {
+        if (commit_root(db, *(argv + 2), root1)
+            || commit_root(db, *(argv + 3), root2)
+            || tree_diff(db, root1, root2, "", print_change, NULL)) {
             ret = 1;
             goto clean_up;
         }
-    } else if (!strcmp(opt, "combine")) {
+    } else if (!strcmp(opt, "repack")) {
+        if ((db = open_repo(script_dir)) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+        /* Cannot vacuum inside of a transaction */
+        if (exec_sql(db, "begin", NULL)
+            || repack(db)
+            || exec_sql(db, "commit", NULL)
+            || exec_sql(db, "vacuum", NULL)) {
+            ret = 1;
+            goto clean_up;
+        }
+    } else if (!strcmp(opt, "import")) {
+        if (import_git(script_dir)) {
+            ret = 1;
+            goto clean_up;
+        }
+    } else if (!strcmp(opt, "subdir")) {
         if (argc != 3) {
             print_usage(prgm_name);
             ret = 1;
             goto clean_up;
         }
 
-        /* Backup */
-        if (cp_file("sloth.db", "sloth_copy.db")) {
+        if ((db = open_repo(script_dir)) == NULL) {
             ret = 1;
             goto clean_up;
         }
 
-        if ((other_sloth_path = strdup(*(argv + 2))) == NULL) {
+        if (exec_sql(db, "begin", NULL)
+            || exec_sql(db, "delete from sloth_tmp_text", NULL)
+            || exec_sql(db, "insert into sloth_tmp_text (x) values (?)",
+                        *(argv + 2))
+            || run_sql(db, script_dir, "subdir.sql")
+            || exec_sql(db, "commit", NULL)) {
             ret = 1;
             goto clean_up;
         }
-
-        if ((cmd =
-             concat("sqlite3 sloth_copy.db \"delete from sloth_tmp_text; ",
-                    "insert into sloth_tmp_text (x) values (\'",
-                    other_sloth_path, "\');\"", NULL)) == NULL)
-            return 1;
-
-        if (sys_cmd(cmd)) {
+    } else if (!strcmp(opt, "combine")) {
+        if (argc != 3) {
+            print_usage(prgm_name);
             ret = 1;
             goto clean_up;
         }
 
-        if (run_sql("sloth_copy.db", script_dir, "combine.sql")) {
+        if ((db = open_repo(script_dir)) == NULL) {
             ret = 1;
             goto clean_up;
         }
 
-        /* Atomic on POSIX */
-        if (mv_file("sloth_copy.db", "sloth.db")) {
+        /* Cannot attach a database inside of a transaction */
+        if (exec_sql(db, "attach database ? as other", *(argv + 2))
+            || get_int(db, "pragma other.user_version", &v)) {
             ret = 1;
             goto clean_up;
         }
-    } else if (!strcmp(opt, "diff")) {
-        if ((tmp_dir = make_tmp_dir(TMP_IN_DIR)) == NULL) {
+
+        /* The blob encodings of the other repository must be understood */
+        if (v != SCHEMA_VERSION) {
+            fprintf(stderr, "%s: Schema version %d, expected %d. "
+                    "Run %s log in that repository first.\n", *(argv + 2),
+                    v, SCHEMA_VERSION, prgm_name);
             ret = 1;
             goto clean_up;
         }
-        if ((cmd =
-             concat("sqlite3 sloth.db \"delete from sloth_tmp_text; ",
-                    "insert into sloth_tmp_text (x) values (\'",
-                    tmp_dir, "\');\"", NULL)) == NULL)
-            return 1;
 
-        if (sys_cmd(cmd)) {
+        if (exec_sql(db, "begin", NULL)
+            || run_sql(db, script_dir, "combine.sql")
+            || exec_sql(db, "commit", NULL)
+            || exec_sql(db, "detach database other", NULL)) {
             ret = 1;
             goto clean_up;
         }
-
-        free(cmd);
-        cmd = NULL;
-
-        if (run_sql("sloth.db", script_dir, "diff.sql")) {
+    } else if (!strcmp(opt, "diff")) {
+        if (argc != 2 && argc != 4) {
+            print_usage(prgm_name);
             ret = 1;
             goto clean_up;
         }
 
-        /* POSIX */
-        if ((cmd = concat("diff -rspT -u ",
-                          "-x sloth.db -x sloth_copy.db -x .track -x .user -x .log -x .git ",
-                          tmp_dir, " .", NULL)) == NULL)
-            return 1;
+        if ((db = open_repo(script_dir)) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
 
-        if (sys_cmd(cmd)) {
+        if (argc == 4) {
+            /* Between two commits, through their manifests */
+            if (sqlite3_prepare_v2(db, "select blob_data(?), blob_data(?)",
+                                   -1, &stmt, NULL) != SQLITE_OK) {
+                fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+                ret = 1;
+                goto clean_up;
+            }
+            if (commit_root(db, *(argv + 2), root1)
+                || commit_root(db, *(argv + 3), root2)
+                || tree_diff(db, root1, root2, "", print_diff, stmt)) {
+                ret = 1;
+                goto clean_up;
+            }
+        } else if (exec_sql(db, "begin", NULL)
+                   || run_sql(db, script_dir, "diff.sql")
+                   || exec_sql(db, "rollback", NULL)) {
+            /* Nothing is kept, the staging tables are only scratch space */
             ret = 1;
             goto clean_up;
         }
@@ -801,13 +5586,16 @@ int main(int argc, char **argv)
     }
 
   clean_up:
+    sqlite3_finalize(stmt);
+    /* Closing the database rolls back any transaction left open */
+    if (sqlite3_close(db) != SQLITE_OK)
+        ret = 1;
+    /* Closing the lock file releases the lock */
+    if (lock_fd != -1 && close(lock_fd))
+        ret = 1;
     free(prgm_name);
     free(script_dir);
     free(opt);
-    free(subdir);
-    free(other_sloth_path);
-    free(tmp_dir);
-    free(cmd);
 
     return ret;
 }
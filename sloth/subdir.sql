@@ -16,20 +16,28 @@
 
 /* sloth subdir SQL */
 
-SQL_OPTS
-
 update sloth_file
-set fn = (select trim(a.x) from sloth_tmp_text as a) || 'DIR_SEP' || fn;
+set fn = (select trim(a.x) from sloth_tmp_text as a) || '/' || fn;
 
 update sloth_commit
 set msg = (select trim(a.x) from sloth_tmp_text as a) || ': ' || msg;
 
+/* Every snapshot has moved, so rebuild the manifests */
+update sloth_commit set root_h = null;
+
+.roots
+
+/* The history has been rewritten, so the next export starts over */
+delete from sloth_blob_mark;
+
+delete from sloth_commit_mark;
+
 /*
  * The .track file is only read during a commit operation, so changes made
  * without a sucessful commit will be discarded.
  */
 update sloth_track
-set fn = (select trim(a.x) from sloth_tmp_text as a) || 'DIR_SEP' || fn;
+set fn = (select trim(a.x) from sloth_tmp_text as a) || '/' || fn;
 
 /* Write .track file. This is not atomic but it is external to the database. */
 .output .track